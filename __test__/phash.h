@@ -0,0 +1 @@
+../phash.h
\ No newline at end of file
@@ -0,0 +1 @@
+../registry.cc
\ No newline at end of file
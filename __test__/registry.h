@@ -0,0 +1 @@
+../registry.h
\ No newline at end of file
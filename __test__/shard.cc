@@ -0,0 +1 @@
+../shard.cc
\ No newline at end of file
@@ -0,0 +1 @@
+../shard.h
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -15,13 +16,17 @@
 #include <errno.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/unistd.h>
 
 #include "args.h"
 #include "codes.h"
 #include "message.h"
+#include "phash.h"
+#include "registry.h"
 #include "rpc.h"
+#include "shard.h"
 
 using namespace args;
 using namespace codes;
@@ -247,6 +252,291 @@ void testExecuteClient(int socketfd) {
     send(msg, socketfd);
 }
 
+vector<pair<string, vector<int>>> createRegistrations() {
+
+    vector<pair<string, vector<int>>> registrations;
+    registrations.push_back(make_pair("foo", vector<int>{(1 << ARG_OUTPUT) | (ARG_INT << 16), 0}));
+    registrations.push_back(make_pair("bar", vector<int>{
+        (1 << ARG_OUTPUT) | (ARG_LONG << 16), (1 << ARG_INPUT) | (ARG_CHAR << 16) | 3, 0}));
+
+    return registrations;
+}
+
+void testRegisterBatchServer(int socketfd) {
+
+    Message msg;
+    msg.setType(MessageType::REGISTER_BATCH);
+    msg.setServerIdentifier("Biscuit");
+    msg.setPort(73);
+    msg.setRegistrations(createRegistrations());
+    send(msg, socketfd);
+
+    Message reply;
+    receive(reply, socketfd, MessageType::REGISTER_BATCH_SUCCESS);
+    assert (reply.getReasonCodes() == (vector<int>{0, WARNING_DUPLICATE_FUNCTION}));
+}
+
+void testRegisterBatchClient(int socketfd) {
+
+    Message msg;
+    receive(msg, socketfd, MessageType::REGISTER_BATCH);
+    assert (string(msg.getServerIdentifier()) == "Biscuit");
+    assert (msg.getPort() == 73);
+    assert (msg.getRegistrations() == createRegistrations());
+
+    Message reply;
+    reply.setType(MessageType::REGISTER_BATCH_SUCCESS);
+    reply.setReasonCodes(vector<int>{0, WARNING_DUPLICATE_FUNCTION});
+    send(reply, socketfd);
+}
+
+void testHeartbeatServer(int socketfd) {
+
+    vector<int> load(NUM_LOAD_STATS);
+    load[LOAD_IN_FLIGHT] = 12;
+    load[LOAD_CONNECTIONS] = 3;
+
+    Message msg;
+    msg.setType(MessageType::HEARTBEAT);
+    msg.setLoad(load);
+    send(msg, socketfd);
+}
+
+void testHeartbeatClient(int socketfd) {
+
+    Message msg;
+    receive(msg, socketfd, MessageType::HEARTBEAT);
+
+    auto load = msg.getLoad();
+    assert (load.size() == NUM_LOAD_STATS);
+    assert (load[LOAD_IN_FLIGHT] == 12);
+    assert (load[LOAD_CONNECTIONS] == 3);
+}
+
+vector<pair<string, int>> createLocations() {
+    return vector<pair<string, int>>{make_pair("Biscuit", 73), make_pair("Gravy", 8080)};
+}
+
+// The binder sends cached LOC_CACHE replies as encoded bytes
+void testEncodedServer(int socketfd) {
+
+    Message msg;
+    msg.setType(MessageType::LOC_CACHE_SUCCESS);
+    msg.setLocations(createLocations());
+    Message::sendEncoded(socketfd, msg.encode());
+}
+
+void testEncodedClient(int socketfd) {
+
+    Message msg;
+    receive(msg, socketfd, MessageType::LOC_CACHE_SUCCESS);
+    assert (msg.getLocations() == createLocations());
+}
+
+void testExecuteTimeoutServer(int socketfd) {
+
+    auto arg_types = createArgTypes();
+    auto args = createArgs();
+
+    Message msg;
+    msg.setType(MessageType::EXECUTE);
+    msg.setName("foo");
+    msg.setTimeout(250);
+    msg.setArgTypes(arg_types);
+    msg.setArgs(args);
+    send(msg, socketfd);
+
+    cleanupArgs(arg_types, args);
+    cleanupArgTypes(arg_types);
+}
+
+void testExecuteTimeoutClient(int socketfd) {
+
+    Message msg;
+    receive(msg, socketfd, MessageType::EXECUTE);
+    assert (string(msg.getName()) == "foo");
+    assert (msg.getTimeout() == 250);
+    assert (msg.numArgs() == 6);
+    assert (*(int*)msg.getArgs()[2] == 7);
+    assert (*(long*)msg.getArgs()[3] == 55);
+}
+
+// Addresses follow each host name after its null terminator,
+// and a location may be sent without one
+void testAddressesServer(int socketfd) {
+
+    Message located;
+    located.setType(MessageType::LOC_SUCCESS);
+    located.setServerIdentifier("Biscuit");
+    located.setPort(73);
+    located.setAddress("192.0.2.2");
+    send(located, socketfd);
+
+    Message with_addresses;
+    with_addresses.setType(MessageType::LOC_CACHE_SUCCESS);
+    with_addresses.setLocations(createLocations(), vector<string>{"192.0.2.2", ""});
+    send(with_addresses, socketfd);
+
+    Message without_addresses;
+    without_addresses.setType(MessageType::LOC_CACHE_SUCCESS);
+    without_addresses.setLocations(createLocations());
+    send(without_addresses, socketfd);
+}
+
+void testAddressesClient(int socketfd) {
+
+    Message located;
+    receive(located, socketfd, MessageType::LOC_SUCCESS);
+    assert (string(located.getServerIdentifier()) == "Biscuit");
+    assert (located.getPort() == 73);
+    assert (string(located.getAddress()) == "192.0.2.2");
+
+    Message with_addresses;
+    receive(with_addresses, socketfd, MessageType::LOC_CACHE_SUCCESS);
+    assert (with_addresses.getLocations() == createLocations());
+    assert (with_addresses.getAddresses() == (vector<string>{"192.0.2.2", ""}));
+
+    Message without_addresses;
+    receive(without_addresses, socketfd, MessageType::LOC_CACHE_SUCCESS);
+    assert (without_addresses.getLocations() == createLocations());
+    assert (without_addresses.getAddresses() == (vector<string>{"", ""}));
+}
+
+// Registration flags follow the registrations as one int array,
+// and older servers send none
+void testFunctionFlagsServer(int socketfd) {
+
+    Message flagged;
+    flagged.setType(MessageType::REGISTER_BATCH);
+    flagged.setServerIdentifier("Biscuit");
+    flagged.setPort(73);
+    flagged.setRegistrations(createRegistrations(), vector<int>{RPC_FUNCTION_PURE, 0});
+    send(flagged, socketfd);
+
+    Message unflagged;
+    unflagged.setType(MessageType::REGISTER_BATCH);
+    unflagged.setServerIdentifier("Biscuit");
+    unflagged.setPort(73);
+    unflagged.setRegistrations(createRegistrations());
+    send(unflagged, socketfd);
+
+    Message located;
+    located.setType(MessageType::LOC_CACHE_SUCCESS);
+    located.setFunctionFlags(RPC_FUNCTION_PURE);
+    located.setLocations(createLocations(), vector<string>{"", "192.0.2.3"});
+    send(located, socketfd);
+}
+
+void testFunctionFlagsClient(int socketfd) {
+
+    Message flagged;
+    receive(flagged, socketfd, MessageType::REGISTER_BATCH);
+    assert (flagged.getRegistrations() == createRegistrations());
+    assert (flagged.getRegistrationFlags() == (vector<int>{RPC_FUNCTION_PURE, 0}));
+
+    Message unflagged;
+    receive(unflagged, socketfd, MessageType::REGISTER_BATCH);
+    assert (unflagged.getRegistrations() == createRegistrations());
+    assert (unflagged.getRegistrationFlags() == (vector<int>{0, 0}));
+
+    Message located;
+    receive(located, socketfd, MessageType::LOC_CACHE_SUCCESS);
+    assert (located.getFunctionFlags() == RPC_FUNCTION_PURE);
+    assert (located.getLocations() == createLocations());
+    assert (located.getAddresses() == (vector<string>{"", "192.0.2.3"}));
+}
+
+// A joining binder only takes signatures from the others, and
+// leaving again gives every one of them back
+void testShardMap() {
+
+    vector<shard::Location> binders{make_pair("Biscuit", 73), make_pair("Gravy", 80),
+        make_pair("Biscuit", 74)};
+    shard::ShardMap shards(binders);
+
+    vector<string> signatures;
+    vector<shard::Location> owners;
+    for (int i = 0; i < 1000; ++i) {
+        signatures.push_back("f" + to_string(i));
+        owners.push_back(shards.owner(signatures.back()));
+    }
+
+    const shard::Location joined("Toast", 75);
+    shards.add(joined);
+    int moved = 0;
+    for (size_t i = 0; i < signatures.size(); ++i) {
+        const auto& owner = shards.owner(signatures[i]);
+        if (owner != owners[i]) {
+            assert (owner == joined);
+            ++moved;
+        }
+    }
+    assert (moved > 0);
+
+    shards.remove(joined);
+    for (size_t i = 0; i < signatures.size(); ++i) {
+        assert (shards.owner(signatures[i]) == owners[i]);
+    }
+}
+
+// A binder that crashed mid-write leaves its last record cut short,
+// which replay must skip while keeping everything before it
+void testRegistry() {
+
+    const string path = "/tmp/registry_test_" + to_string(getpid());
+    unlink(path.c_str());
+
+    const registry::Location biscuit("Biscuit", 73);
+    {
+        registry::Registry persistent;
+        registry::State state;
+        assert (persistent.open(path, state));
+        assert (state.empty());
+
+        persistent.add(biscuit, "foo");
+        persistent.add(make_pair("Gravy", 80), "bar");
+    }
+
+    // Cut the last record short
+    struct stat info;
+    int status = stat(path.c_str(), &info);
+    assert (status == 0);
+    status = truncate(path.c_str(), info.st_size - 2);
+    assert (status == 0);
+
+    registry::Registry persistent;
+    registry::State state;
+    assert (persistent.open(path, state));
+    assert (state.size() == 1);
+    assert (state[biscuit] == (unordered_set<string>{"foo"}));
+
+    unlink(path.c_str());
+}
+
+// Every key built into the table is found, and nothing else is
+void testPhash() {
+
+    const phash::Table<int> empty;
+    assert (empty.size() == 0);
+    assert (empty.find("foo") == nullptr);
+
+    vector<pair<string, int>> entries;
+    for (int i = 0; i < 500; ++i) {
+        entries.push_back(make_pair("f" + to_string(i), i));
+    }
+
+    const phash::Table<int> table(entries);
+    assert (table.size() == entries.size());
+    for (const auto& entry : entries) {
+        const int* value = table.find(entry.first);
+        assert (value != nullptr && *value == entry.second);
+    }
+
+    assert (table.find("f500") == nullptr);
+    assert (table.find("") == nullptr);
+    assert (table.find("f1 ") == nullptr);
+}
+
 void runServer() {
 
     int socketfd = socket(PF_INET, SOCK_STREAM, 0);
@@ -268,6 +558,12 @@ void runServer() {
 
     //testRegisterServer(client);
     testExecuteServer(client);
+    testRegisterBatchServer(client);
+    testHeartbeatServer(client);
+    testEncodedServer(client);
+    testExecuteTimeoutServer(client);
+    testAddressesServer(client);
+    testFunctionFlagsServer(client);
 }
 
 void runClient() {
@@ -286,10 +582,20 @@ void runClient() {
 
     //testRegisterClient(socketfd);
     testExecuteClient(socketfd);
+    testRegisterBatchClient(socketfd);
+    testHeartbeatClient(socketfd);
+    testEncodedClient(socketfd);
+    testExecuteTimeoutClient(socketfd);
+    testAddressesClient(socketfd);
+    testFunctionFlagsClient(socketfd);
 }
 
 int main() {
 
+    testShardMap();
+    testRegistry();
+    testPhash();
+
     thread server(runServer);
     thread client(runClient);
 
@@ -105,4 +105,40 @@ void copyArgs(void** dest, void** src, int* arg_types) {
     }
 }
 
+string callKey(const string& signature, int* arg_types, void** args) {
+    const int num_args = numArgs(arg_types);
+
+    // The arg types hold array lengths, which the signature leaves out
+    string key = signature;
+    key.append(1, '\0');
+    key.append((const char*)arg_types, sizeof(*arg_types) * num_args);
+    for (int i = 0; i < num_args; ++i) {
+        if (isInput(arg_types[i])) {
+            key.append((const char*)args[i], argSize(arg_types[i]));
+        }
+    }
+    return key;
+}
+
+string packOutputs(int* arg_types, void** args) {
+    string outputs;
+    for (int i = 0; i < numArgs(arg_types); ++i) {
+        if (isOutput(arg_types[i])) {
+            outputs.append((const char*)args[i], argSize(arg_types[i]));
+        }
+    }
+    return outputs;
+}
+
+void unpackOutputs(void** dest, int* arg_types, const string& outputs) {
+    size_t offset = 0;
+    for (int i = 0; i < numArgs(arg_types); ++i) {
+        if (isOutput(arg_types[i])) {
+            const int size = argSize(arg_types[i]);
+            memcpy(dest[i], outputs.data() + offset, size);
+            offset += size;
+        }
+    }
+}
+
 }
@@ -25,5 +25,13 @@ std::string getSignature(const char* name, int* arg_types);
 void copyArgTypes(int* dest, int* src);
 void copyArgs(void** dest, void** src, int* arg_types);
 
+// Identify a call by its signature, arg types and the bytes of its input args
+// This must be taken before the call overwrites any input/output args
+std::string callKey(const std::string& signature, int* arg_types, void** args);
+
+// Pack the bytes of every output arg, in order, and copy them back
+std::string packOutputs(int* arg_types, void** args);
+void unpackOutputs(void** dest, int* arg_types, const std::string& outputs);
+
 }
 #endif // __ARGS_H__
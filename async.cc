@@ -0,0 +1,634 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "args.h"
+#include "async.h"
+#include "codes.h"
+#include "message.h"
+using namespace args;
+using namespace codes;
+using namespace message;
+using namespace std;
+
+namespace async {
+
+// A call in progress
+struct Call {
+    vector<Location> locations;     // Servers to try, in order
+    size_t next;                    // The next server not tried yet
+    string request;                 // Encoded EXECUTE request
+    int* arg_types;                 // Caller's arg types, updated on success
+    void** args;                    // Caller's args, outputs filled on success
+    Deadline deadline;
+    chrono::milliseconds hedge_delay;
+    vector<shared_ptr<Attempt>> attempts;   // Attempts in progress (I/O thread only)
+    Timers::iterator expiry;                // Its entry in expiries, if it has a deadline
+    Callback callback;              // Reports completion if there is no handle
+    void* context;
+    bool done;
+    int status;
+
+    Call(const vector<Location>& locations, const string& request,
+        int* arg_types, void** args, const Deadline& deadline,
+        chrono::milliseconds hedge_delay, Callback callback, void* context):
+        locations(locations), next(0), request(request), arg_types(arg_types),
+        args(args), deadline(deadline), hedge_delay(hedge_delay), callback(callback),
+        context(context), done(false), status(0) {
+    }
+};
+
+// One exchange of the request with one server
+// A call has one attempt, or two while it is hedged
+struct Attempt {
+    enum State {
+        CONNECTING,                 // Waiting for a new connection to open
+        SENDING,                    // Writing the EXECUTE request
+        RECEIVING,                  // Reading the reply
+    };
+
+    shared_ptr<Call> call;
+    size_t index;                   // The server tried
+    bool hedge;                     // Whether this was sent by hedging
+    int socket;
+    bool reused;                    // Whether the connection came from the pool
+    State state;
+    size_t sent;                    // Bytes of the request sent so far
+    unique_ptr<Message> reply;
+
+    Attempt(const shared_ptr<Call>& call, bool hedge):
+        call(call), index(call->next++), hedge(hedge), socket(-1),
+        reused(false), state(CONNECTING), sent(0) {
+    }
+
+    const Location& location() const {
+        return call->locations[index];
+    }
+};
+
+// How often attempts parked for a pool slot look for one again, since
+// slots are freed by other threads too
+static const chrono::milliseconds PARK_INTERVAL(5);
+
+static void setBlocking(int socketfd, bool blocking) {
+    int flags = fcntl(socketfd, F_GETFL, 0);
+    fcntl(socketfd, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+}
+
+// Open a non-blocking connection, setting pending if it is still in progress
+// Returns the socket or a negative error code
+static int openSocket(resolve::Resolver& resolver, const Location& location, bool& pending) {
+    resolve::Address address;
+    int status = resolver.resolve(location.first, to_string(location.second), address);
+    if (status < 0) {
+        return status;
+    }
+
+    int socketfd = socket(address.family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (socketfd == -1) {
+        return ERROR_SOCKET_CREATE;
+    }
+
+    status = ::connect(socketfd, (sockaddr*)&address.storage, address.length);
+    if (status == -1 && errno != EINPROGRESS) {
+        close(socketfd);
+        return ERROR_SOCKET_CONNECT;
+    }
+
+    pending = status == -1;
+    return socketfd;
+}
+
+Engine::Engine(pool::ConnectionPool& connections, resolve::Resolver& resolver):
+    connections(connections), resolver(resolver),
+    epollfd(-1), wakefd(-1), stopping(false), next_handle(1),
+    hedgeable(0), hedged(0), hedge_wins(0) {
+}
+
+Engine::~Engine() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+
+    if (io_thread.joinable()) {
+        const unsigned long long one = 1;
+        if (write(wakefd, &one, sizeof(one)) == sizeof(one)) {
+            io_thread.join();
+        } else {
+            io_thread.detach();
+        }
+    }
+
+    // Break the cycles between calls and their attempts
+    for (const auto& attempt : active) {
+        connections.discard(attempt.second->location(), attempt.first);
+        attempt.second->call->attempts.clear();
+    }
+
+    if (epollfd != -1) {
+        close(epollfd);
+    }
+    if (wakefd != -1) {
+        close(wakefd);
+    }
+}
+
+// Start the I/O thread on first use
+// Must be called with the lock held
+int Engine::start() {
+    if (io_thread.joinable()) {
+        return 0;
+    }
+
+    epollfd = epoll_create1(0);
+    wakefd = eventfd(0, EFD_NONBLOCK);
+    if (epollfd == -1 || wakefd == -1) {
+        return ERROR_SOCKET_CREATE;
+    }
+
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = wakefd;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &event) < 0) {
+        return ERROR_SOCKET_CREATE;
+    }
+
+    io_thread = thread(&Engine::run, this);
+    return 0;
+}
+
+int Engine::submit(const vector<Location>& locations, const string& request,
+    int* arg_types, void** args, const Deadline& deadline, chrono::milliseconds hedge_delay) {
+
+    if (locations.empty()) {
+        return ERROR_MISSING_FUNCTION;
+    }
+
+    if (hedge_delay.count() > 0) {
+        ++hedgeable;
+    }
+
+    return enqueue(make_shared<Call>(locations, request, arg_types, args,
+        deadline, hedge_delay, nullptr, nullptr), true);
+}
+
+int Engine::submit(const vector<Location>& locations, const string& request,
+    int* arg_types, void** args, Callback callback, void* context,
+    const Deadline& deadline) {
+
+    if (locations.empty()) {
+        return ERROR_MISSING_FUNCTION;
+    }
+
+    int status = enqueue(make_shared<Call>(locations, request, arg_types, args,
+        deadline, chrono::milliseconds::zero(), callback, context), false);
+    return status < 0 ? status : 0;
+}
+
+// Hand a call to the I/O thread, giving it a handle if tracked
+// Returns the handle (0 if untracked) or a negative error code
+int Engine::enqueue(const shared_ptr<Call>& call, bool tracked) {
+    int handle = 0;
+    {
+        lock_guard<mutex> guard(lock);
+        int status = start();
+        if (status < 0) {
+            return status;
+        }
+
+        if (tracked) {
+            handle = next_handle++;
+            handles[handle] = call;
+        }
+        submitted.push_back(call);
+    }
+
+    // Wake the I/O thread to start the call
+    const unsigned long long one = 1;
+    if (write(wakefd, &one, sizeof(one)) != sizeof(one)) {
+        lock_guard<mutex> guard(lock);
+        handles.erase(handle);
+        auto it = find(submitted.begin(), submitted.end(), call);
+        if (it != submitted.end()) {
+            submitted.erase(it);
+        }
+        return ERROR_MESSAGE_SEND;
+    }
+
+    return handle;
+}
+
+void Engine::run() {
+    epoll_event events[64];
+
+    for (;;) {
+        int num_events = epoll_wait(epollfd, events, 64, nextTimeout());
+        if (num_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (int i = 0; i < num_events; ++i) {
+            const int fd = events[i].data.fd;
+            if (fd != wakefd) {
+                // Hold a reference since handling may remove it from active
+                auto it = active.find(fd);
+                if (it != active.end()) {
+                    auto attempt = it->second;
+                    handle(attempt);
+                }
+                continue;
+            }
+
+            // Start every newly submitted call
+            unsigned long long count;
+            if (read(wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                return;
+            }
+
+            deque<shared_ptr<Call>> calls;
+            {
+                lock_guard<mutex> guard(lock);
+                if (stopping) {
+                    return;
+                }
+                calls.swap(submitted);
+            }
+
+            const auto now = chrono::steady_clock::now();
+            for (const auto& call : calls) {
+                call->expiry = expiries.end();
+                if (call->deadline != Deadline::max()) {
+                    call->expiry = expiries.emplace(call->deadline, call);
+                }
+                if (call->hedge_delay.count() > 0 && call->locations.size() > 1) {
+                    hedges.emplace(now + call->hedge_delay, call);
+                }
+
+                auto attempt = make_shared<Attempt>(call, false);
+                call->attempts.push_back(attempt);
+                connect(attempt);
+            }
+        }
+
+        startHedges();
+        resumeParked();
+        expireCalls();
+    }
+}
+
+// Milliseconds until the next hedge or deadline is due, or until parked
+// attempts should look for a pool slot again, or -1 if there is none
+int Engine::nextTimeout() {
+    if (hedges.empty() && expiries.empty() && parked.empty()) {
+        return -1;
+    }
+
+    auto due = Deadline::max();
+    if (!parked.empty()) {
+        due = chrono::steady_clock::now() + PARK_INTERVAL;
+    }
+    if (!hedges.empty()) {
+        due = min(due, hedges.begin()->first);
+    }
+    if (!expiries.empty()) {
+        due = min(due, expiries.begin()->first);
+    }
+    return remainingMs(due);
+}
+
+// Send a second attempt for every call that is still waiting on its
+// first when its hedge delay runs out
+void Engine::startHedges() {
+    const auto now = chrono::steady_clock::now();
+    while (!hedges.empty() && hedges.begin()->first <= now) {
+        auto call = hedges.begin()->second;
+        hedges.erase(hedges.begin());
+
+        if (call->done || call->attempts.empty() || call->next >= call->locations.size()) {
+            continue;
+        }
+
+        ++hedged;
+        auto attempt = make_shared<Attempt>(call, true);
+        call->attempts.push_back(attempt);
+        connect(attempt);
+    }
+}
+
+// Fail every call whose deadline passed, closing its connections
+void Engine::expireCalls() {
+    const auto now = chrono::steady_clock::now();
+    while (!expiries.empty() && expiries.begin()->first <= now) {
+        auto call = expiries.begin()->second;
+        for (const auto& attempt : call->attempts) {
+            detach(attempt);
+        }
+        complete(call, ERROR_DEADLINE_EXCEEDED);
+    }
+}
+
+// Connect the attempts that were waiting for a pool slot, unless their
+// call finished or dropped them meanwhile. Ones that still find every
+// slot taken are parked again
+void Engine::resumeParked() {
+    deque<shared_ptr<Attempt>> waiting;
+    waiting.swap(parked);
+    for (const auto& attempt : waiting) {
+        const auto& attempts = attempt->call->attempts;
+        if (!attempt->call->done &&
+            find(attempts.begin(), attempts.end(), attempt) != attempts.end()) {
+            connect(attempt);
+        }
+    }
+}
+
+// Start the attempt on its location, reusing a pooled connection
+// if there is an idle one
+// New connections take a pool slot like synchronous calls do, so
+// without a free one the attempt is parked until a slot frees up
+void Engine::connect(const shared_ptr<Attempt>& attempt) {
+    int socketfd = connections.acquireIdle(attempt->location());
+    attempt->reused = socketfd >= 0;
+    attempt->sent = 0;
+
+    if (attempt->reused) {
+        setBlocking(socketfd, false);
+        attempt->state = Attempt::SENDING;
+    } else {
+        if (!connections.reserve(attempt->location())) {
+            parked.push_back(attempt);
+            return;
+        }
+
+        bool pending = false;
+        socketfd = openSocket(resolver, attempt->location(), pending);
+        if (socketfd < 0) {
+            connections.unreserve(attempt->location());
+            retry(attempt, socketfd);
+            return;
+        }
+
+        attempt->state = pending ? Attempt::CONNECTING : Attempt::SENDING;
+    }
+
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLOUT;
+    event.data.fd = socketfd;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, socketfd, &event) < 0) {
+        connections.discard(attempt->location(), socketfd);
+        fail(attempt, ERROR_SOCKET_CREATE);
+        return;
+    }
+
+    attempt->socket = socketfd;
+    active[socketfd] = attempt;
+}
+
+// Stop watching the attempt's socket and close it
+void Engine::detach(const shared_ptr<Attempt>& attempt) {
+    if (attempt->socket < 0) {
+        return;
+    }
+
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, attempt->socket, nullptr);
+    active.erase(attempt->socket);
+    connections.discard(attempt->location(), attempt->socket);
+    attempt->socket = -1;
+}
+
+void Engine::handle(const shared_ptr<Attempt>& attempt) {
+    switch (attempt->state) {
+        case Attempt::CONNECTING:
+            finishConnect(attempt);
+            break;
+        case Attempt::SENDING:
+            sendRequest(attempt);
+            break;
+        case Attempt::RECEIVING:
+            recvReply(attempt);
+            break;
+    }
+}
+
+void Engine::finishConnect(const shared_ptr<Attempt>& attempt) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(attempt->socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+        detach(attempt);
+        retry(attempt, ERROR_SOCKET_CONNECT);
+        return;
+    }
+
+    attempt->state = Attempt::SENDING;
+    sendRequest(attempt);
+}
+
+void Engine::sendRequest(const shared_ptr<Attempt>& attempt) {
+    const string& request = attempt->call->request;
+    while (attempt->sent < request.size()) {
+        int bytes = send(attempt->socket, request.data() + attempt->sent,
+            request.size() - attempt->sent, MSG_NOSIGNAL);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+
+        if (bytes < 0) {
+            // A pooled connection may have been closed by the server,
+            // so try the same server again on another connection.
+            // Otherwise the request never arrived whole, so try the next
+            detach(attempt);
+            if (attempt->reused) {
+                connect(attempt);
+            } else {
+                retry(attempt, ERROR_MESSAGE_SEND);
+            }
+            return;
+        }
+
+        attempt->sent += bytes;
+    }
+
+    // Wait for the reply
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = attempt->socket;
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, attempt->socket, &event);
+
+    attempt->state = Attempt::RECEIVING;
+    attempt->reply.reset(new Message());
+}
+
+void Engine::recvReply(const shared_ptr<Attempt>& attempt) {
+    auto& reply = *attempt->reply;
+    try {
+        reply.recvNonBlock(attempt->socket);
+    } catch (Message::RecvError) {
+        // The call may have run, so it is never retried
+        detach(attempt);
+        fail(attempt, ERROR_MESSAGE_RECV);
+        return;
+    }
+
+    if (!reply.eom()) {
+        return;
+    }
+
+    // The exchange completed, so the connection can be reused
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, attempt->socket, nullptr);
+    active.erase(attempt->socket);
+    setBlocking(attempt->socket, true);
+    connections.release(attempt->location(), attempt->socket);
+    attempt->socket = -1;
+
+    // A busy server refused the request without running it, so the
+    // next location can safely be tried
+    const int reason_code = reply.getReasonCode();
+    if (reply.getType() == MessageType::EXECUTE_FAILURE &&
+        (reason_code == ERROR_SERVER_BUSY || reason_code == ERROR_FUNCTION_BUSY)) {
+        retry(attempt, reason_code);
+        return;
+    }
+
+    // The first reply wins, so cancel the other attempt of a hedged call
+    auto call = attempt->call;
+    for (const auto& other : call->attempts) {
+        if (other != attempt) {
+            detach(other);
+        }
+    }
+    if (attempt->hedge) {
+        ++hedge_wins;
+    }
+
+    // If server replies with EXECUTE_SUCCESS, copy arguments to args and argTypes
+    if (reply.getType() == MessageType::EXECUTE_SUCCESS) {
+        copyArgTypes(call->arg_types, reply.getArgTypes());
+        copyArgs(call->args, reply.getArgs(), reply.getArgTypes());
+        complete(call, 0);
+    } else {
+        complete(call, reply.getReasonCode());
+    }
+}
+
+// The request never reached the attempt's server, so try the next one
+void Engine::retry(const shared_ptr<Attempt>& attempt, int status) {
+    auto& call = attempt->call;
+    if (call->next < call->locations.size()) {
+        attempt->index = call->next++;
+        connect(attempt);
+    } else {
+        fail(attempt, status);
+    }
+}
+
+// The attempt ended without a reply
+// The call fails once it has no other attempt left
+void Engine::fail(const shared_ptr<Attempt>& attempt, int status) {
+    auto call = attempt->call;
+    auto& attempts = call->attempts;
+    attempts.erase(remove(attempts.begin(), attempts.end(), attempt), attempts.end());
+
+    if (attempts.empty() && !call->done) {
+        complete(call, status);
+    }
+}
+
+void Engine::complete(const shared_ptr<Call>& call, int status) {
+    call->attempts.clear();
+    if (call->expiry != expiries.end()) {
+        expiries.erase(call->expiry);
+        call->expiry = expiries.end();
+    }
+    if (call->callback) {
+        call->done = true;
+        call->callback(call->context, status);
+        return;
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        call->status = status;
+        call->done = true;
+    }
+
+    completed.notify_all();
+}
+
+// Hand back a completed call's status and forget its handle
+// Must be called with the lock held
+int Engine::collect(int handle) {
+    auto it = handles.find(handle);
+    const int status = it->second->status;
+    handles.erase(it);
+    return status;
+}
+
+int Engine::wait(int handle) {
+    unique_lock<mutex> guard(lock);
+    auto it = handles.find(handle);
+    if (it == handles.end()) {
+        return ERROR_INVALID_HANDLE;
+    }
+
+    auto call = it->second;
+    completed.wait(guard, [&call] { return call->done; });
+    return collect(handle);
+}
+
+int Engine::poll(int handle, int& status) {
+    lock_guard<mutex> guard(lock);
+    auto it = handles.find(handle);
+    if (it == handles.end()) {
+        return ERROR_INVALID_HANDLE;
+    }
+
+    if (!it->second->done) {
+        return 0;
+    }
+
+    status = collect(handle);
+    return 1;
+}
+
+void Engine::hedgeStats(long& calls, long& hedged, long& wins) const {
+    calls = hedgeable;
+    hedged = this->hedged;
+    wins = hedge_wins;
+}
+
+int Engine::waitAny(const int* handles, int count, int& index) {
+    unique_lock<mutex> guard(lock);
+    index = -1;
+
+    for (;;) {
+        for (int i = 0; i < count; ++i) {
+            auto it = this->handles.find(handles[i]);
+            if (it == this->handles.end()) {
+                return ERROR_INVALID_HANDLE;
+            }
+
+            if (it->second->done) {
+                index = i;
+                return collect(handles[i]);
+            }
+        }
+
+        completed.wait(guard);
+    }
+}
+
+}
@@ -0,0 +1,118 @@
+#ifndef __ASYNC_H__
+#define __ASYNC_H__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "pool.h"
+#include "resolve.h"
+
+namespace async {
+
+typedef std::pair<std::string, int> Location;
+typedef std::chrono::steady_clock::time_point Deadline;
+
+struct Call;
+struct Attempt;
+
+// Calls by when something is due for them
+typedef std::multimap<std::chrono::steady_clock::time_point, std::shared_ptr<Call>> Timers;
+
+// Called on the I/O thread with the status of a completed call
+typedef void (*Callback)(void* context, int status);
+
+// Runs calls to servers on a single I/O thread using epoll
+// Calls are submitted from any thread and completed on the I/O thread,
+// which copies the outputs into the caller's args
+// A hedged call sends the request to a second location if the first has
+// not replied within the hedge delay, and takes whichever reply comes first
+class Engine {
+    pool::ConnectionPool& connections;
+    resolve::Resolver& resolver;
+    std::thread io_thread;
+    int epollfd;                                            // Watches every call's socket
+    int wakefd;                                             // eventfd to wake the I/O thread
+    bool stopping;
+
+    std::mutex lock;                                        // Guards everything below
+    std::condition_variable completed;                      // Signalled when any call completes
+    std::deque<std::shared_ptr<Call>> submitted;            // Calls the I/O thread has yet to start
+    std::unordered_map<int, std::shared_ptr<Call>> handles; // Calls the caller has yet to collect
+    int next_handle;
+
+    // I/O thread only
+    std::unordered_map<int, std::shared_ptr<Attempt>> active;    // Attempts in progress, by socket
+    Timers hedges;                                          // When to hedge calls
+    Timers expiries;                                        // When calls reach their deadline
+    std::deque<std::shared_ptr<Attempt>> parked;            // Attempts waiting for a pool slot
+
+    std::atomic<long> hedgeable;                            // Calls submitted with a hedge delay
+    std::atomic<long> hedged;                               // Calls a second attempt was sent for
+    std::atomic<long> hedge_wins;                           // Calls the second attempt answered first
+
+public:
+    Engine(pool::ConnectionPool& connections, resolve::Resolver& resolver);
+    ~Engine();
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+
+    // Start a call, trying the locations in order until one accepts
+    // the connection, hedging on the next one after hedge_delay if it is
+    // positive. The call fails if it has not completed by the deadline
+    // Returns a handle or a negative error code
+    int submit(const std::vector<Location>& locations, const std::string& request,
+        int* arg_types, void** args, const Deadline& deadline = Deadline::max(),
+        std::chrono::milliseconds hedge_delay = std::chrono::milliseconds::zero());
+
+    // Start a call that reports its status to callback instead of a handle
+    // Returns 0 or a negative error code, in which case callback is never called
+    int submit(const std::vector<Location>& locations, const std::string& request,
+        int* arg_types, void** args, Callback callback, void* context,
+        const Deadline& deadline = Deadline::max());
+
+    // Wait for a call to complete and return its status
+    int wait(int handle);
+
+    // Check whether a call has completed
+    // Returns 1 and sets status if it has, 0 if not, or an error code
+    int poll(int handle, int& status);
+
+    // Wait for any of the calls to complete, setting index to it
+    int waitAny(const int* handles, int count, int& index);
+
+    // Get the hedging counters
+    void hedgeStats(long& calls, long& hedged, long& wins) const;
+
+private:
+    int start();
+    int enqueue(const std::shared_ptr<Call>& call, bool tracked);
+    void run();
+    int nextTimeout();
+    void startHedges();
+    void expireCalls();
+    void resumeParked();
+    void connect(const std::shared_ptr<Attempt>& attempt);
+    void handle(const std::shared_ptr<Attempt>& attempt);
+    void detach(const std::shared_ptr<Attempt>& attempt);
+    void finishConnect(const std::shared_ptr<Attempt>& attempt);
+    void sendRequest(const std::shared_ptr<Attempt>& attempt);
+    void recvReply(const std::shared_ptr<Attempt>& attempt);
+    void retry(const std::shared_ptr<Attempt>& attempt, int status);
+    void fail(const std::shared_ptr<Attempt>& attempt, int status);
+    void complete(const std::shared_ptr<Call>& call, int status);
+    int collect(int handle);
+};
+
+}
+
+#endif // __ASYNC_H__
@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <random>
+
+#include "balance.h"
+using namespace std;
+
+namespace balance {
+
+static const double EWMA_WEIGHT = 0.2;             // Weight of the newest sample
+static const chrono::milliseconds MIN_BACKOFF(100);
+static const chrono::milliseconds MAX_BACKOFF(5000);
+
+Balancer::Stats::Stats(): latency(0), outstanding(0), backoff(MIN_BACKOFF) {
+}
+
+// Expected wait of a new call, so unmeasured locations are tried first
+double Balancer::cost(const Stats& stats) const {
+    return stats.latency * (stats.outstanding + 1);
+}
+
+vector<Location> Balancer::order(const vector<Location>& locations) {
+    static thread_local minstd_rand random(random_device{}());
+    const Time now = chrono::steady_clock::now();
+
+    vector<pair<double, Location>> up;
+    vector<pair<Time, Location>> down;
+    {
+        lock_guard<mutex> guard(lock);
+        for (const auto& location : locations) {
+            const Stats& s = stats[location];
+            if (s.down_until > now) {
+                down.emplace_back(s.down_until, location);
+            } else {
+                up.emplace_back(cost(s), location);
+            }
+        }
+    }
+
+    // Power of two choices: the cheaper of two random locations goes first
+    if (up.size() > 1) {
+        size_t first = random() % up.size();
+        size_t second = random() % (up.size() - 1);
+        if (second >= first) {
+            ++second;
+        }
+        if (up[second].first < up[first].first) {
+            first = second;
+        }
+        swap(up[0], up[first]);
+        stable_sort(up.begin() + 1, up.end(),
+            [](const pair<double, Location>& a, const pair<double, Location>& b) {
+                return a.first < b.first;
+            });
+    }
+    sort(down.begin(), down.end());
+
+    vector<Location> ordered;
+    ordered.reserve(locations.size());
+    for (const auto& entry : up) {
+        ordered.push_back(entry.second);
+    }
+    for (const auto& entry : down) {
+        ordered.push_back(entry.second);
+    }
+    return ordered;
+}
+
+Time Balancer::start(const Location& location) {
+    lock_guard<mutex> guard(lock);
+    ++stats[location].outstanding;
+    return chrono::steady_clock::now();
+}
+
+void Balancer::finish(const Location& location, Time started, bool reachable) {
+    const Time now = chrono::steady_clock::now();
+    lock_guard<mutex> guard(lock);
+    Stats& s = stats[location];
+    --s.outstanding;
+
+    // Mark the location down, backing off further while it keeps failing
+    if (!reachable) {
+        s.down_until = now + s.backoff;
+        s.backoff = min(s.backoff * 2, MAX_BACKOFF);
+        return;
+    }
+
+    const double sample = chrono::duration_cast<chrono::microseconds>(now - started).count();
+    s.latency = s.latency == 0 ? sample : EWMA_WEIGHT * sample + (1 - EWMA_WEIGHT) * s.latency;
+    s.backoff = MIN_BACKOFF;
+}
+
+}
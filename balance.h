@@ -0,0 +1,51 @@
+#ifndef __BALANCE_H__
+#define __BALANCE_H__
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace balance {
+
+typedef std::pair<std::string, int> Location;
+typedef std::chrono::steady_clock::time_point Time;
+
+// Spreads calls over the locations of a function
+// Tracks the latency (EWMA) and outstanding calls of every location and
+// picks the cheaper of two random ones, skipping locations that recently
+// failed until their backoff runs out
+class Balancer {
+    struct Stats {
+        double latency;                     // EWMA of call latency in microseconds
+        int outstanding;                    // Calls in progress
+        Time down_until;                    // Skipped until then
+        std::chrono::milliseconds backoff;  // How long the next failure marks it down
+
+        Stats();
+    };
+
+    std::mutex lock;
+    std::map<Location, Stats> stats;
+
+public:
+    // Order locations so the preferred one comes first, followed by the
+    // others by cost and then those still down, most recently up first
+    std::vector<Location> order(const std::vector<Location>& locations);
+
+    // Count a call to a location as outstanding, returning when it started
+    Time start(const Location& location);
+
+    // Record the outcome of a call, marking the location down if it
+    // could not be reached
+    void finish(const Location& location, Time started, bool reachable);
+
+private:
+    double cost(const Stats& stats) const;
+};
+
+}
+
+#endif // __BALANCE_H__
@@ -1,7 +1,10 @@
 #include "args.h"
 #include "codes.h"
 #include "message.h"
+#include "registry.h"
+#include "shard.h"
 #include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <cstring>
@@ -13,6 +16,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <stdlib.h>
+#include <getopt.h>
 #include <utility>
 #include <vector>
 
@@ -20,14 +24,18 @@ using namespace args;
 using namespace codes;
 using namespace std;
 using namespace message;
+using namespace shard;
 
 struct Entry {
     string name;
     int port;
+    string address;                             // Numeric address clients reach the server at, if known
     unordered_set<string> functions;
+    chrono::steady_clock::time_point expires;   // When the server's lease runs out
+    int in_flight;                              // Calls in progress at the last heartbeat
     
     Entry(const pair<string, int>& location):
-        name(location.first), port(location.second) {
+        name(location.first), port(location.second), in_flight(0) {
     }
 
     friend bool operator== (const Entry&, const Entry&);
@@ -40,33 +48,198 @@ bool operator== (const Entry& e1, const Entry& e2) {
 vector<Entry> database;
 int database_index = 0;
 unordered_map<int, pair<string, int>> servers;
+unordered_set<int> server_sockets;      // Connections servers register or heartbeat on
 unordered_map<int, Message> requests;
+ShardMap shards;                        // Every binder in the cluster
+Location self;                          // This binder's place in shards
+unordered_map<int, Location> binders;   // Binders that joined this one, by socket
+int seed_socket = -1;                   // Connection to the binder this one joined
+registry::Registry persistent;          // On-disk copy of the database
+unordered_map<string, string> location_cache;  // Encoded LOC_CACHE replies, by signature
+unordered_map<string, int> function_flags;      // Flags of the latest registration, by signature
+
+// Servers loaded from disk must reconnect within this time to stay registered
+const chrono::seconds REVALIDATE_TIMEOUT(30);
+
+// Servers must heartbeat or register within this time to stay registered
+chrono::milliseconds lease(3000);
+
+// Forget the cached LOC_CACHE replies for the given functions
+void invalidateLocations(const unordered_set<string>& functions) {
+    for (const auto& signature : functions) {
+        location_cache.erase(signature);
+    }
+}
 
-void registerFunction(int socketfd) {
+// Build a snapshot of the database for the registry file
+registry::State databaseState() {
+    registry::State state;
+    for (const auto& entry : database) {
+        state[make_pair(entry.name, entry.port)] = entry.functions;
+    }
+
+    return state;
+}
+
+// Keep the registry file from growing without bound
+void compactRegistry() {
+    if (persistent.needsCompaction()) {
+        persistent.compact(databaseState());
+    }
+}
+
+// Reload the database from disk
+// Loaded servers are served optimistically until they reconnect
+// or the revalidation timeout passes
+bool loadRegistry(const string& path) {
+    registry::State state;
+    if (!persistent.open(path, state)) {
+        return false;
+    }
+
+    const auto expires = chrono::steady_clock::now() + REVALIDATE_TIMEOUT;
+    for (const auto& server : state) {
+        Entry entry(server.first);
+        entry.functions = server.second;
+        entry.expires = expires;
+        database.push_back(entry);
+    }
+
+    return true;
+}
+
+// Push the current shard map to every joined binder and every server,
+// so servers can register moved functions with their new owners
+void broadcastShardMap() {
+    Message msg;
+    msg.setType(MessageType::SHARD_MAP_SUCCESS);
+    msg.setLocations(shards.all());
+
+    for (const auto& binder : binders) {
+        try {
+            msg.sendMessage(binder.first);
+        } catch(...) {
+        }
+    }
+
+    for (const int socketfd : server_sockets) {
+        try {
+            msg.sendMessage(socketfd);
+        } catch(...) {
+        }
+    }
+}
+
+// Another binder joined the cluster and now owns a shard
+void joinBinder(int socketfd) {
     auto& msg = requests[socketfd];
-    const string signature = getSignature(msg.getName(), msg.getArgTypes());
-    auto location = make_pair(msg.getServerIdentifier(), msg.getPort());
+    const Location location(msg.getServerIdentifier(), msg.getPort());
+
+    binders[socketfd] = location;
+    shards.add(location);
+    broadcastShardMap();
+}
+
+// The seed binder sent us an updated shard map
+void updateShardMap(int socketfd) {
+    auto& msg = requests[socketfd];
+    shards = ShardMap(msg.getLocations());
+    broadcastShardMap();
+}
+
+void getShardMap(int socketfd) {
+    auto& msg = requests[socketfd];
+    msg.setType(MessageType::SHARD_MAP_SUCCESS);
+    msg.setLocations(shards.all());
+
+    try {
+        msg.sendMessage(socketfd);
+    } catch(...) {
+    }
+}
+
+// Get the numeric address clients should reach a server at
+// This is the address its registrations came from, unless that is a
+// loopback address because the server shares this binder's host. Then the
+// address the server sent is used, if it is not a loopback address too.
+// Otherwise clients resolve the server's host name themselves
+string serverAddress(int socketfd, const string& sent) {
+    sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+    char address[48];
+    if (getpeername(socketfd, (sockaddr*)&peer, &length) == 0 &&
+        getnameinfo((sockaddr*)&peer, length, address, sizeof(address),
+            nullptr, 0, NI_NUMERICHOST) == 0 && !isLoopback(address)) {
+        return address;
+    }
+
+    return isLoopback(sent) ? "" : sent;
+}
+
+// Add a function to a server's slot, returning the reason code
+int addFunction(const pair<string, int>& location, const string& signature,
+    const string& address) {
+
     Entry entry(location);
-    servers[socketfd] = location; 
-    
+    entry.address = address;
+    int reason_code = 0;
+
     auto it = find(database.begin(), database.end(), entry);
     if (it != database.end()) {
+        // Registering renews the lease, which also revalidates
+        // a server loaded from disk
+        it->expires = chrono::steady_clock::now() + lease;
+        if (!address.empty() && it->address != address) {
+            it->address = address;
+            invalidateLocations(it->functions);
+        }
+
         // Check existing slot for server
         // If signature doesn't exist, add it
         auto& functions = it->functions;
         if (functions.find(signature) == functions.end()) {
             functions.insert(signature);
-            msg.setReasonCode(0);
+            persistent.add(location, signature);
+            location_cache.erase(signature);
         } else {
-            msg.setReasonCode(WARNING_DUPLICATE_FUNCTION);
+            reason_code = WARNING_DUPLICATE_FUNCTION;
         }
     } else {
         // Create a new slot for the server and add signature
         entry.functions.insert(signature);
+        entry.expires = chrono::steady_clock::now() + lease;
         database.push_back(entry);
-        msg.setReasonCode(0);
+        persistent.add(location, signature);
+        location_cache.erase(signature);
     }
 
+    return reason_code;
+}
+
+// Record the flags of a function's latest registration
+// Clients learn them from location replies, so a change drops the
+// cached reply. They are not kept in the registry file, since servers
+// send them again when they register after a restart
+void updateFunctionFlags(const string& signature, int flags) {
+    int& current = function_flags[signature];
+    if (current != flags) {
+        current = flags;
+        location_cache.erase(signature);
+    }
+}
+
+// A single REGISTER carries no flags, so it clears any the function had
+void registerFunction(int socketfd) {
+    auto& msg = requests[socketfd];
+    const string signature = getSignature(msg.getName(), msg.getArgTypes());
+    auto location = make_pair(msg.getServerIdentifier(), msg.getPort());
+    servers[socketfd] = location; 
+    server_sockets.insert(socketfd);
+
+    msg.setReasonCode(addFunction(location, signature, serverAddress(socketfd, "")));
+    updateFunctionFlags(signature, 0);
+    compactRegistry();
+
     try {
         msg.setType(MessageType::REGISTER_SUCCESS);
         msg.sendMessage(socketfd);
@@ -74,31 +247,100 @@ void registerFunction(int socketfd) {
     }
 }
 
+// Register many functions in one request
+// The reply carries one reason code per function, in order
+void registerBatch(int socketfd) {
+    auto& msg = requests[socketfd];
+    auto location = make_pair(msg.getServerIdentifier(), msg.getPort());
+    servers[socketfd] = location; 
+    server_sockets.insert(socketfd);
+
+    const string address = serverAddress(socketfd, msg.getAddress());
+    vector<int> reason_codes;
+    auto registrations = msg.getRegistrations();
+    const auto flags = msg.getRegistrationFlags();
+    for (size_t i = 0; i < registrations.size(); ++i) {
+        const string signature = getSignature(registrations[i].first.c_str(),
+            registrations[i].second.data());
+        reason_codes.push_back(addFunction(location, signature, address));
+        updateFunctionFlags(signature, flags[i]);
+    }
+    compactRegistry();
+
+    try {
+        msg.setType(MessageType::REGISTER_BATCH_SUCCESS);
+        msg.setReasonCodes(reason_codes);
+        msg.sendMessage(socketfd);
+    } catch(...) {
+    }
+}
+
+// A server is still alive, so renew its lease and record its load
+void heartbeat(int socketfd) {
+    auto& msg = requests[socketfd];
+
+    // Servers heartbeat every binder, including ones that own none of
+    // their functions, which still need to hear about new shard maps
+    server_sockets.insert(socketfd);
+    if (servers.find(socketfd) == servers.end()) {
+        return;
+    }
+
+    const Entry entry(servers[socketfd]);
+    auto it = find(database.begin(), database.end(), entry);
+    if (it != database.end()) {
+        const auto load = msg.getLoad();
+        it->expires = chrono::steady_clock::now() + lease;
+        it->in_flight = load.empty() ? 0 : load[LOAD_IN_FLIGHT];
+    }
+}
+
+// Why a lookup found no server: clients that ask for a function this
+// binder does not own have an old shard map, and need to fetch it again
+int missingReason(const string& signature) {
+    return shards.owner(signature) == self ? ERROR_MISSING_FUNCTION : ERROR_MOVED_FUNCTION;
+}
+
 void getLocation(int socketfd) {
     auto& msg = requests[socketfd];
     const string signature = getSignature(msg.getName(), msg.getArgTypes());
     const int size = database.size();
-    int i;
+    const Entry* chosen = nullptr;
+    int first = 0;
 
     // Round-robin scheduling
-    // Each server is checked at most once
-    for (i = 0; i < size; ++i) {
-        const auto& entry = database[database_index++];
-        database_index %= size;
-
-        // If we have a match, send the info the the client
-        if (entry.functions.find(signature) != entry.functions.end()) {
-            msg.setType(MessageType::LOC_SUCCESS);
-            msg.setServerIdentifier(entry.name.c_str());
-            msg.setPort(entry.port);
-            break;
+    // Each server is checked at most once. Of the next two servers
+    // with the function, the one reporting fewer calls in flight wins
+    for (int i = 0, matches = 0; i < size && matches < 2; ++i) {
+        const int index = (database_index + i) % size;
+        const auto& entry = database[index];
+        if (entry.functions.find(signature) == entry.functions.end()) {
+            continue;
         }
+
+        if (chosen == nullptr) {
+            first = index;
+        }
+
+        if (chosen == nullptr || entry.in_flight < chosen->in_flight) {
+            chosen = &entry;
+        }
+        ++matches;
     }
 
-    // No servers were found
-    if (i == size) {
+    // If we have a match, send the info the the client
+    if (chosen != nullptr) {
+        database_index = (first + 1) % size;
+        msg.setType(MessageType::LOC_SUCCESS);
+        msg.setServerIdentifier(chosen->name.c_str());
+        msg.setPort(chosen->port);
+        msg.setAddress(chosen->address.c_str());
+        auto flags = function_flags.find(signature);
+        msg.setFunctionFlags(flags == function_flags.end() ? 0 : flags->second);
+    } else {
+        // No servers were found
         msg.setType(MessageType::LOC_FAILURE);
-        msg.setReasonCode(ERROR_MISSING_FUNCTION);
+        msg.setReasonCode(missingReason(signature));
     }
 
     try {
@@ -110,42 +352,44 @@ void getLocation(int socketfd) {
 void getAllLocations(int socketfd) {
     auto& msg = requests[socketfd];
     const string signature = getSignature(msg.getName(), msg.getArgTypes());
-    vector<pair<string, int>> locations;
 
-    // Get the location of every registered server
-    for (auto& entry : database) {
-        if (entry.functions.find(signature) != entry.functions.end()) {
-            locations.push_back(make_pair(entry.name, entry.port));
+    // The reply only changes when registrations do, so it is
+    // encoded once and reused until then
+    auto cached = location_cache.find(signature);
+    if (cached == location_cache.end()) {
+        vector<pair<string, int>> locations;
+        vector<string> addresses;
+
+        // Get the location of every registered server
+        for (auto& entry : database) {
+            if (entry.functions.find(signature) != entry.functions.end()) {
+                locations.push_back(make_pair(entry.name, entry.port));
+                addresses.push_back(entry.address);
+            }
         }
-    }
 
-    int num_args = locations.size() * 2;
-    if (num_args == 0) {
-        msg.setType(MessageType::LOC_FAILURE);
-        msg.setReasonCode(ERROR_MISSING_FUNCTION);
-    } else {
-        // Send all location backs to the client
-        unique_ptr<int[]> arg_types(new int[num_args + 1]);
-        unique_ptr<void*[]> args(new void*[num_args]);
-
-        // Locations are sent as args in pairs
-        // First arg is the identifier, second arg is the port
-        for (int i = 0; i < num_args; i += 2) {
-            const auto& str = locations[i].first;
-            arg_types[i] = (ARG_CHAR << 16) | (str.length() + 1);
-            arg_types[i + 1] = (ARG_INT << 16);
-            args[i] = (void*)str.c_str();
-            args[i + 1] = &(locations[i].second);
+        if (locations.empty()) {
+            msg.setType(MessageType::LOC_FAILURE);
+            msg.setReasonCode(missingReason(signature));
+
+            try {
+                msg.sendMessage(socketfd);
+            } catch(...) {
+            }
+            return;
         }
-        arg_types[num_args] = 0;
 
-        msg.setType(MessageType::LOC_CACHE_SUCCESS);
-        msg.setArgTypes(arg_types.get());
-        msg.setArgs(args.get());
+        // Send all location backs to the client
+        Message reply;
+        reply.setType(MessageType::LOC_CACHE_SUCCESS);
+        reply.setLocations(locations, addresses);
+        auto flags = function_flags.find(signature);
+        reply.setFunctionFlags(flags == function_flags.end() ? 0 : flags->second);
+        cached = location_cache.insert(make_pair(signature, reply.encode())).first;
     }
 
     try {
-        msg.sendMessage(socketfd);
+        Message::sendEncoded(socketfd, cached->second);
     } catch(...) {
     }
 }
@@ -162,7 +406,10 @@ void cleanup(int socketfd, fd_set& master_set) {
         auto it = find(database.begin(), database.end(), entry);
 
         if (it != database.end()) {
+            invalidateLocations(it->functions);
             database.erase(it);
+            persistent.remove(location);
+            compactRegistry();
             if (database.size() > 0) {
                 database_index %= database.size();
             } else {
@@ -172,16 +419,163 @@ void cleanup(int socketfd, fd_set& master_set) {
 
         servers.erase(socketfd);
     }
+    server_sockets.erase(socketfd);
+
+    // A joined binder left, so its shard is handed back to the others
+    if (binders.find(socketfd) != binders.end()) {
+        shards.remove(binders[socketfd]);
+        binders.erase(socketfd);
+        broadcastShardMap();
+    }
+
+    if (socketfd == seed_socket) {
+        seed_socket = -1;
+    }
+}
+
+// Drop every server whose lease ran out
+// Live connections are closed, so the server notices and registers again
+void expireLeases(fd_set& master_set) {
+    const auto now = chrono::steady_clock::now();
+    vector<pair<string, int>> expired;
+    for (const auto& entry : database) {
+        if (entry.expires <= now) {
+            expired.push_back(make_pair(entry.name, entry.port));
+        }
+    }
+
+    for (const auto& location : expired) {
+        int socketfd = -1;
+        for (const auto& server : servers) {
+            if (server.second == location) {
+                socketfd = server.first;
+            }
+        }
+
+        if (socketfd != -1) {
+            cleanup(socketfd, master_set);
+            continue;
+        }
+
+        // A server loaded from disk that never reconnected
+        auto it = find(database.begin(), database.end(), Entry(location));
+        invalidateLocations(it->functions);
+        database.erase(it);
+        persistent.remove(location);
+    }
+
+    database_index = database.empty() ? 0 : database_index % database.size();
+    compactRegistry();
+}
+
+// When the next lease runs out
+chrono::steady_clock::time_point nextExpiry() {
+    auto next = chrono::steady_clock::time_point::max();
+    for (const auto& entry : database) {
+        next = min(next, entry.expires);
+    }
+
+    return next;
 }
 
-int main() {
+// Connect to the seed binder and announce ourselves as a new shard
+int joinCluster(const string& seed, const char* host_name, int port) {
+    const auto colon = seed.rfind(':');
+    if (colon == string::npos) {
+        return -1;
+    }
+
+    const string seed_addr = seed.substr(0, colon);
+    const string seed_port = seed.substr(colon + 1);
+
+    addrinfo host_info, *host_info_list;
+    memset(&host_info, 0, sizeof host_info);
+    host_info.ai_family = AF_UNSPEC;
+    host_info.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(seed_addr.c_str(), seed_port.c_str(), &host_info, &host_info_list) != 0) {
+        return -1;
+    }
+
+    int socketfd = socket(host_info_list->ai_family, host_info_list->ai_socktype, host_info_list->ai_protocol);
+    if (socketfd == -1) {
+        freeaddrinfo(host_info_list);
+        return -1;
+    }
+
+    int status = connect(socketfd, host_info_list->ai_addr, host_info_list->ai_addrlen);
+    freeaddrinfo(host_info_list);
+    if (status == -1) {
+        close(socketfd);
+        return -1;
+    }
+
+    Message msg;
+    msg.setType(MessageType::BINDER_JOIN);
+    msg.setServerIdentifier(host_name);
+    msg.setPort(port);
+
+    try {
+        msg.sendMessage(socketfd);
+    } catch(...) {
+        close(socketfd);
+        return -1;
+    }
+
+    return socketfd;
+}
+
+void usage(const char* program) {
+    cerr << "usage: " << program << " [-p port] [-f registry_file]"
+        << " [-l lease_ms] [-j seed_address:seed_port]" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    // Binders started with -j join an existing binder's cluster
+    // and own a shard of the signature space
+    // Binders started with -f keep their registry on disk, and with -p
+    // listen on a fixed port, so that a restart is invisible to clients
+    const char* seed = nullptr;
+    const char* listen_port = "0";
+    const char* registry_file = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:p:f:l:")) != -1) {
+        switch (opt) {
+            case 'j':
+                seed = optarg;
+                break;
+            case 'p':
+                listen_port = optarg;
+                break;
+            case 'f':
+                registry_file = optarg;
+                break;
+            case 'l':
+                // A lease of zero would expire every server on every loop
+                if (atoi(optarg) <= 0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                lease = chrono::milliseconds(atoi(optarg));
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
     addrinfo host_info, *host_info_list;
     memset(&host_info, 0, sizeof host_info);
     host_info.ai_family = AF_UNSPEC;
     host_info.ai_socktype = SOCK_STREAM;
     host_info.ai_flags = AI_PASSIVE;
 
-    int status = getaddrinfo(NULL, "0", &host_info, &host_info_list); 
+    if (registry_file != nullptr && !loadRegistry(registry_file)) {
+        cerr << "registry error" << endl;
+        return EXIT_FAILURE;
+    }
+
+    int status = getaddrinfo(NULL, listen_port, &host_info, &host_info_list); 
     if (status < 0) {
         cerr << "getaddrinfo error: " << gai_strerror(status) << endl;
         return EXIT_FAILURE;
@@ -195,6 +589,10 @@ int main() {
         return EXIT_FAILURE;
     }
 
+    // Allow a restarted binder to reuse its port straight away
+    int reuse = 1;
+    setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Bind
     status = bind(socketfd, host_info_list->ai_addr, host_info_list->ai_addrlen);
     freeaddrinfo(host_info_list);
@@ -237,16 +635,53 @@ int main() {
     int port = ntohs(addr.sin_port);
     cout << "BINDER_ADDRESS " << host->h_name << endl;
     cout << "BINDER_PORT " << port << endl;
+    self = make_pair(host->h_name, port);
+    shards.add(self);
 
     fd_set master_set, read_set;
     FD_ZERO(&master_set);
     FD_SET(socketfd, &master_set);
     int maxfd = socketfd;
 
+    if (seed != nullptr) {
+        seed_socket = joinCluster(seed, host->h_name, port);
+        if (seed_socket < 0) {
+            cerr << "join error" << endl;
+            close(socketfd);
+            return EXIT_FAILURE;
+        }
+
+        FD_SET(seed_socket, &master_set);
+        maxfd = max(maxfd, seed_socket);
+    }
+
     for(;;) {
         bool terminate = false;
         read_set = master_set;
-        select(maxfd + 1, &read_set, nullptr, nullptr, nullptr);
+
+        // Wake up in time to drop servers whose lease runs out
+        timeval timeout, *wait = nullptr;
+        const auto next_expiry = nextExpiry();
+        if (next_expiry != chrono::steady_clock::time_point::max()) {
+            auto remaining = chrono::duration_cast<chrono::microseconds>(
+                next_expiry - chrono::steady_clock::now()).count();
+            remaining = max(remaining, 0L);
+            timeout.tv_sec = remaining / 1000000;
+            timeout.tv_usec = remaining % 1000000;
+            wait = &timeout;
+        }
+
+        select(maxfd + 1, &read_set, nullptr, nullptr, wait);
+        if (chrono::steady_clock::now() >= next_expiry) {
+            expireLeases(master_set);
+
+            // Sockets closed by expiry must not be read below
+            for (int i = 0; i <= maxfd; ++i) {
+                if (!FD_ISSET(i, &master_set)) {
+                    FD_CLR(i, &read_set);
+                }
+            }
+        }
 
         // Go through the sockets with data on them
         for (int i = 0; i <= maxfd; ++i) {
@@ -257,7 +692,10 @@ int main() {
             if (i == socketfd) {
                 // Accept an incoming connection
                 int client = accept(socketfd, nullptr, nullptr);
-                if (client != -1) {
+                if (client >= FD_SETSIZE) {
+                    // select cannot watch it
+                    close(client);
+                } else if (client != -1) {
                     FD_SET(client, &master_set);
                     maxfd = max(maxfd, client);
                 }
@@ -271,20 +709,40 @@ int main() {
                     }
 
                     // Handle the request
-                    // If the request is not a server request,
-                    // close the connection after servicing
+                    // Connections stay open after servicing, so clients
+                    // can keep one session for many lookups
                     switch (msg.getType()) {
                         case MessageType::REGISTER:
                             registerFunction(i);
                             requests.erase(i);
                             break;
+                        case MessageType::REGISTER_BATCH:
+                            registerBatch(i);
+                            requests.erase(i);
+                            break;
+                        case MessageType::HEARTBEAT:
+                            heartbeat(i);
+                            requests.erase(i);
+                            break;
                         case MessageType::LOC_REQUEST:
                             getLocation(i);
-                            cleanup(i, master_set);
+                            requests.erase(i);
                             break;
                         case MessageType::LOC_CACHE:
                             getAllLocations(i);
-                            cleanup(i, master_set);
+                            requests.erase(i);
+                            break;
+                        case MessageType::SHARD_MAP:
+                            getShardMap(i);
+                            requests.erase(i);
+                            break;
+                        case MessageType::BINDER_JOIN:
+                            joinBinder(i);
+                            requests.erase(i);
+                            break;
+                        case MessageType::SHARD_MAP_SUCCESS:
+                            updateShardMap(i);
+                            requests.erase(i);
                             break;
                         case MessageType::TERMINATE:
                             terminate = true;
@@ -313,11 +771,19 @@ int main() {
     Message msg;
     msg.setType(MessageType::TERMINATE);
 
-    // Tell all servers to terminate
-    for (const auto& server : servers) {
-        msg.sendMessage(server.first);
+    // Tell all servers to terminate, including ones that registered
+    // nothing here, since a server stops when any binder tells it to
+    for (const int socketfd : server_sockets) {
+        try {
+            msg.sendMessage(socketfd);
+        } catch(...) {
+        }
     }
 
+    // Joined binders going away with us must not hand their shards back,
+    // or servers would follow the new map instead of terminating
+    binders.clear();
+
     // Close all connections
     for (int i = 0; i <= maxfd; ++i) {
         if (FD_ISSET(i, &master_set)) {
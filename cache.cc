@@ -0,0 +1,125 @@
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+
+#include "cache.h"
+using namespace std;
+
+namespace cache {
+
+namespace {
+
+// Hold a shard's lock for the rest of the scope
+struct ReadLock {
+    pthread_rwlock_t& lock;
+
+    explicit ReadLock(pthread_rwlock_t& lock): lock(lock) {
+        pthread_rwlock_rdlock(&lock);
+    }
+    ~ReadLock() {
+        pthread_rwlock_unlock(&lock);
+    }
+};
+
+struct WriteLock {
+    pthread_rwlock_t& lock;
+
+    explicit WriteLock(pthread_rwlock_t& lock): lock(lock) {
+        pthread_rwlock_wrlock(&lock);
+    }
+    ~WriteLock() {
+        pthread_rwlock_unlock(&lock);
+    }
+};
+
+// Mark an entry used, writing its stamp at most once per millisecond
+// so that hot entries are not written by every lookup
+void touch(atomic<long long>& last_used) {
+    const long long now = chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+    if (last_used.load(memory_order_relaxed) != now) {
+        last_used.store(now, memory_order_relaxed);
+    }
+}
+
+}
+
+Options::Options(): capacity(1024) {
+}
+
+// Get the default options, overridden by the environment
+Options Options::fromEnv() {
+    Options options;
+    const char* str = getenv("RPC_CACHE_SIZE");
+    if (str != nullptr && atoi(str) > 0) {
+        options.capacity = atoi(str);
+    }
+    return options;
+}
+
+LocationCache::Shard::Shard() {
+    pthread_rwlock_init(&lock, nullptr);
+}
+
+LocationCache::Shard::~Shard() {
+    pthread_rwlock_destroy(&lock);
+}
+
+LocationCache::LocationCache(const Options& options):
+    shard_capacity((options.capacity + NUM_SHARDS - 1) / NUM_SHARDS) {
+}
+
+LocationCache::Shard& LocationCache::shardOf(const string& signature) {
+    return shards[hash<string>()(signature) % NUM_SHARDS];
+}
+
+Locations LocationCache::get(const string& signature) {
+    Shard& shard = shardOf(signature);
+    ReadLock guard(shard.lock);
+
+    auto it = shard.entries.find(signature);
+    if (it == shard.entries.end()) {
+        return nullptr;
+    }
+
+    touch(it->second->last_used);
+    return it->second->locations;
+}
+
+Locations LocationCache::put(const string& signature, vector<Location> locations) {
+    Locations snapshot = make_shared<const vector<Location>>(move(locations));
+    Shard& shard = shardOf(signature);
+    WriteLock guard(shard.lock);
+
+    auto it = shard.entries.find(signature);
+    if (it != shard.entries.end()) {
+        it->second->locations = snapshot;
+        touch(it->second->last_used);
+        return snapshot;
+    }
+
+    // Make room by dropping the entry least recently looked up
+    if (shard.entries.size() >= shard_capacity) {
+        auto stalest = shard.entries.begin();
+        for (auto entry = shard.entries.begin(); entry != shard.entries.end(); ++entry) {
+            if (entry->second->last_used < stalest->second->last_used) {
+                stalest = entry;
+            }
+        }
+        shard.entries.erase(stalest);
+    }
+
+    unique_ptr<Entry> entry(new Entry());
+    entry->locations = snapshot;
+    touch(entry->last_used);
+    shard.entries[signature] = move(entry);
+    return snapshot;
+}
+
+void LocationCache::erase(const string& signature) {
+    Shard& shard = shardOf(signature);
+    WriteLock guard(shard.lock);
+    shard.entries.erase(signature);
+}
+
+}
@@ -0,0 +1,73 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+namespace cache {
+
+typedef std::pair<std::string, int> Location;
+typedef std::shared_ptr<const std::vector<Location>> Locations;
+
+struct Options {
+    int capacity;                   // Signatures kept across all shards
+
+    Options();
+    static Options fromEnv();
+};
+
+// Locations of functions by signature, shared by every client thread
+// Signatures are spread over shards with their own lock, so threads
+// looking up different functions rarely contend. Lookups share the lock
+// and only stamp the entry with when it was used, so threads calling the
+// same function do not serialize either. Eviction is approximately LRU:
+// a full shard drops its stalest entry when a signature is added.
+// Readers get an immutable snapshot of the locations, so no lock is held
+// while calling servers
+class LocationCache {
+    static const int NUM_SHARDS = 16;
+
+    struct Entry {
+        Locations locations;
+        std::atomic<long long> last_used;   // Milliseconds on the steady clock
+    };
+
+    struct Shard {
+        pthread_rwlock_t lock;  // Shared by lookups, exclusive for changes
+        std::unordered_map<std::string, std::unique_ptr<Entry>> entries;
+
+        Shard();
+        ~Shard();
+    };
+
+    Shard shards[NUM_SHARDS];
+    size_t shard_capacity;
+
+public:
+    explicit LocationCache(const Options& options);
+    LocationCache(const LocationCache&) = delete;
+    LocationCache& operator=(const LocationCache&) = delete;
+
+    // Look up a signature, returning null if it is not cached
+    Locations get(const std::string& signature);
+
+    // Cache the locations of a signature, evicting the least recently
+    // used signature of its shard if it is full
+    Locations put(const std::string& signature, std::vector<Location> locations);
+
+    // Forget a signature, eg once the binder no longer knows it
+    void erase(const std::string& signature);
+
+private:
+    Shard& shardOf(const std::string& signature);
+};
+
+}
+
+#endif // __CACHE_H__
@@ -23,6 +23,11 @@ namespace codes {
         ERROR_NOT_CONNECTED_BINDER = -15,           // The server is not connected to the binder, ie the binder socket has not been created on the server
         ERROR_SERVER_NOT_RUNNING = -16,             // The server is not running, ie the socket for clients to connect to has not been created
         ERROR_LOST_CONNECTION_BINDER = -17,         // The binder disconnected from the server
+        ERROR_INVALID_HANDLE = -18,                 // The async call handle is unknown or was already collected
+        ERROR_DEADLINE_EXCEEDED = -19,              // The call did not complete before its deadline
+        ERROR_SERVER_BUSY = -20,                    // The server's request queue is full, so another server should be tried
+        ERROR_FUNCTION_BUSY = -21,                  // The function's queue on the server is full, so another server should be tried
+        ERROR_MOVED_FUNCTION = -22,                 // The binder asked does not own the function, ie the caller's shard map is out of date
     };
 }
 
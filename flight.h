@@ -0,0 +1,77 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "codes.h"
+
+namespace flight {
+
+typedef std::chrono::steady_clock::time_point Deadline;
+
+// Lets identical concurrent requests share one result
+// The first caller with a key runs the request, and callers with the
+// same key that arrive before it finishes wait and get a copy of its
+// status and result instead of running their own
+template <typename Result>
+class Group {
+    struct Flight {
+        bool done;
+        int status;
+        Result result;
+
+        Flight(): done(false), status(0) {
+        }
+    };
+
+    std::mutex lock;
+    std::condition_variable landed;
+    std::unordered_map<std::string, std::shared_ptr<Flight>> flights;
+
+public:
+    // Run request, or wait until the deadline for an identical one in flight
+    // shared is set when the result came from another caller
+    int run(const std::string& key, const std::function<int(Result&)>& request,
+        Result& result, bool& shared, const Deadline& deadline = Deadline::max()) {
+
+        std::unique_lock<std::mutex> guard(lock);
+        auto it = flights.find(key);
+        if (it != flights.end()) {
+            std::shared_ptr<Flight> flight = it->second;
+            shared = true;
+            if (deadline == Deadline::max()) {
+                landed.wait(guard, [&] { return flight->done; });
+            } else if (!landed.wait_until(guard, deadline, [&] { return flight->done; })) {
+                return codes::ERROR_DEADLINE_EXCEEDED;
+            }
+
+            result = flight->result;
+            return flight->status;
+        }
+
+        std::shared_ptr<Flight> flight = std::make_shared<Flight>();
+        flights[key] = flight;
+        shared = false;
+        guard.unlock();
+
+        const int status = request(result);
+
+        guard.lock();
+        flight->done = true;
+        flight->status = status;
+        flight->result = result;
+        flights.erase(key);
+        landed.notify_all();
+        return status;
+    }
+};
+
+}
+
+#endif // __FLIGHT_H__
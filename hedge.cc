@@ -0,0 +1,73 @@
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include "hedge.h"
+using namespace std;
+
+namespace hedge {
+
+Options::Options(): percentile(95) {
+}
+
+// Get the default options, overridden by the environment
+Options Options::fromEnv() {
+    Options options;
+    const char* str = getenv("RPC_HEDGE_PERCENTILE");
+    if (str != nullptr && atoi(str) > 0 && atoi(str) < 100) {
+        options.percentile = atoi(str);
+    }
+    return options;
+}
+
+Policy::Policy(const Options& options): options(options) {
+}
+
+void Policy::markIdempotent(const string& signature) {
+    lock_guard<mutex> guard(lock);
+    functions[signature];
+}
+
+bool Policy::idempotent(const string& signature) {
+    lock_guard<mutex> guard(lock);
+    return functions.find(signature) != functions.end();
+}
+
+bool Policy::idempotent(const string& signature, chrono::milliseconds& delay) {
+    vector<long> latencies;
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = functions.find(signature);
+        if (it == functions.end()) {
+            return false;
+        }
+        latencies.assign(it->second.latencies.begin(), it->second.latencies.end());
+    }
+
+    delay = chrono::milliseconds::zero();
+    if (latencies.size() < MIN_SAMPLES) {
+        return true;
+    }
+
+    // Round up to whole milliseconds, since that is what the I/O thread waits in
+    auto nth = latencies.begin() + (latencies.size() - 1) * options.percentile / 100;
+    nth_element(latencies.begin(), nth, latencies.end());
+    delay = chrono::milliseconds(*nth / 1000 + 1);
+    return true;
+}
+
+void Policy::record(const string& signature, chrono::microseconds latency) {
+    lock_guard<mutex> guard(lock);
+    auto it = functions.find(signature);
+    if (it == functions.end()) {
+        return;
+    }
+
+    auto& latencies = it->second.latencies;
+    latencies.push_back(latency.count());
+    if (latencies.size() > WINDOW) {
+        latencies.pop_front();
+    }
+}
+
+}
@@ -0,0 +1,50 @@
+#ifndef __HEDGE_H__
+#define __HEDGE_H__
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace hedge {
+
+struct Options {
+    int percentile;                 // Latency percentile a hedged call waits for
+
+    Options();
+    static Options fromEnv();
+};
+
+// Decides which functions are hedged and how long to wait before hedging
+// Only functions marked idempotent are hedged, since they may run twice.
+// The delay is a percentile of the function's recent latencies
+class Policy {
+    static const size_t WINDOW = 128;       // Latencies kept per function
+    static const size_t MIN_SAMPLES = 16;   // Latencies needed before hedging
+
+    struct Function {
+        std::deque<long> latencies;         // Most recent at the back, in microseconds
+    };
+
+    Options options;
+    std::mutex lock;
+    std::unordered_map<std::string, Function> functions;   // Idempotent functions
+
+public:
+    explicit Policy(const Options& options);
+
+    void markIdempotent(const std::string& signature);
+    bool idempotent(const std::string& signature);
+
+    // Whether a function is idempotent, setting delay to how long a call
+    // should wait before hedging, or zero until enough calls were timed
+    bool idempotent(const std::string& signature, std::chrono::milliseconds& delay);
+
+    // Record the latency of a completed call
+    void record(const std::string& signature, std::chrono::microseconds latency);
+};
+
+}
+
+#endif // __HEDGE_H__
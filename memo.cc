@@ -0,0 +1,106 @@
+#include <cstdlib>
+
+#include "args.h"
+#include "memo.h"
+using namespace std;
+using namespace args;
+
+namespace memo {
+
+// Per-entry bookkeeping counted against the capacity
+static const size_t ENTRY_OVERHEAD = 64;
+
+Options::Options(): capacity(4 << 20), ttl(10000) {
+}
+
+// Get the default options, overridden by the environment
+Options Options::fromEnv() {
+    Options options;
+    const char* str = getenv("RPC_MEMO_BYTES");
+    if (str != nullptr && atol(str) >= 0) {
+        options.capacity = atol(str);
+    }
+    str = getenv("RPC_MEMO_TTL_MS");
+    if (str != nullptr && atoi(str) > 0) {
+        options.ttl = atoi(str);
+    }
+    return options;
+}
+
+ResultCache::ResultCache(const Options& options):
+    options(options), bytes(0), hits(0), misses(0) {
+}
+
+void ResultCache::setPure(const string& signature, bool pure) {
+    lock_guard<mutex> guard(lock);
+    if (pure && options.capacity > 0) {
+        functions.insert(signature);
+    } else {
+        functions.erase(signature);
+    }
+}
+
+bool ResultCache::pure(const string& signature) {
+    lock_guard<mutex> guard(lock);
+    return functions.find(signature) != functions.end();
+}
+
+bool ResultCache::lookup(const string& key, int* arg_types, void** args) {
+    string outputs;
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = index.find(key);
+        if (it == index.end() || it->second->expires <= chrono::steady_clock::now()) {
+            if (it != index.end()) {
+                evict(it->second);
+            }
+            ++misses;
+            return false;
+        }
+
+        entries.splice(entries.begin(), entries, it->second);
+        outputs = it->second->outputs;
+    }
+    ++hits;
+
+    // Same arg types as the stored call, since they are part of the key
+    unpackOutputs(args, arg_types, outputs);
+    return true;
+}
+
+void ResultCache::store(const string& key, int* arg_types, void** args) {
+    string outputs = packOutputs(arg_types, args);
+    const size_t size = key.size() + outputs.size() + ENTRY_OVERHEAD;
+    if (size > options.capacity) {
+        return;
+    }
+
+    lock_guard<mutex> guard(lock);
+    auto it = index.find(key);
+    if (it != index.end()) {
+        evict(it->second);
+    }
+
+    entries.push_front(Entry{key, move(outputs),
+        chrono::steady_clock::now() + chrono::milliseconds(options.ttl)});
+    index[key] = entries.begin();
+    bytes += size;
+
+    while (bytes > options.capacity) {
+        evict(prev(entries.end()));
+    }
+}
+
+void ResultCache::stats(long& hits, long& misses) const {
+    hits = this->hits;
+    misses = this->misses;
+}
+
+// Drop an entry, with the lock held
+void ResultCache::evict(Entries::iterator it) {
+    bytes -= it->key.size() + it->outputs.size() + ENTRY_OVERHEAD;
+    index.erase(it->key);
+    entries.erase(it);
+}
+
+}
@@ -0,0 +1,71 @@
+#ifndef __MEMO_H__
+#define __MEMO_H__
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace memo {
+
+struct Options {
+    size_t capacity;                // Bytes of keys and results kept, 0 to disable
+    int ttl;                        // Milliseconds a result is reused for
+
+    Options();
+    static Options fromEnv();
+};
+
+// Results of calls to pure functions, keyed by signature and input args
+// Servers declare functions pure when registering and the binder passes
+// that on with their locations. A hit fills the output args without
+// any network traffic
+class ResultCache {
+    typedef std::chrono::steady_clock::time_point Time;
+
+    struct Entry {
+        std::string key;
+        std::string outputs;        // Every output arg, in order
+        Time expires;
+    };
+
+    typedef std::list<Entry> Entries;
+
+    Options options;
+    std::mutex lock;
+    Entries entries;                // Most recently used at the front
+    std::unordered_map<std::string, Entries::iterator> index;
+    std::unordered_set<std::string> functions;     // Pure signatures
+    size_t bytes;
+    std::atomic<long> hits;
+    std::atomic<long> misses;
+
+public:
+    explicit ResultCache(const Options& options);
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+
+    // Record what the binder said about a function
+    void setPure(const std::string& signature, bool pure);
+    bool pure(const std::string& signature);
+
+    // Copy a cached result into the output args, returning whether there was one
+    // Calls are keyed by args::callKey
+    bool lookup(const std::string& key, int* arg_types, void** args);
+
+    // Cache the output args of a successful call, evicting the least
+    // recently used results to stay within capacity
+    void store(const std::string& key, int* arg_types, void** args);
+
+    void stats(long& hits, long& misses) const;
+
+private:
+    void evict(Entries::iterator it);
+};
+
+}
+
+#endif // __MEMO_H__
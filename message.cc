@@ -1,19 +1,62 @@
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
 #include <iostream>
 
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 
 #include "args.h"
 #include "message.h"
+#include "rpc.h"
 using namespace args;
 using namespace std;
 
 namespace message {
 
+int remainingMs(const Deadline& deadline) {
+    if (deadline == Deadline::max()) {
+        return -1;
+    }
+
+    const auto left = deadline - chrono::steady_clock::now();
+    if (left.count() <= 0) {
+        return 0;
+    }
+    return chrono::duration_cast<chrono::milliseconds>(left).count() + 1;
+}
+
+bool isLoopback(const string& address) {
+    return address.compare(0, 4, "127.") == 0 || address == "::1" ||
+        address.compare(0, 11, "::ffff:127.") == 0;
+}
+
+// Wait until the socket is ready for events or the deadline passes
+static void waitFor(const int& socket, short events, const Deadline& deadline) {
+    pollfd pfd;
+    pfd.fd = socket;
+    pfd.events = events;
+
+    for (;;) {
+        const int timeout = remainingMs(deadline);
+        if (timeout == 0) {
+            throw Message::TimeoutError();
+        }
+
+        int ready = poll(&pfd, 1, timeout);
+        if (ready > 0) {
+            return;
+        } else if (ready < 0 && errno != EINTR) {
+            throw Message::RecvError();
+        }
+    }
+}
+
 // Constructor
 Message::Message(): length(0), type(MessageType::NONE), name{0},
-    server_identifier{0}, port(0), reason_code(0), num_args(0),
+    server_identifier{0}, address{0}, port(0), reason_code(0), timeout(0),
+    function_flags(0), num_args(0),
     arg_types(nullptr), args(nullptr), raw_index(0), total_bytes(0),
     flags(0), HEADER_SIZE(sizeof(length) + sizeof(type)) {
 }
@@ -41,11 +84,27 @@ void Message::setServerIdentifier(const char* identifier) {
     memcpy(this->server_identifier, identifier, len);
 }
 
+// Set the numeric address of the server
+void Message::setAddress(const char* address) {
+    const int len = min(sizeof(this->address), strlen(address) + 1);
+    memcpy(this->address, address, len);
+}
+
 // Set the server port
 void Message::setPort(const int& port) {
     this->port = port;    
 }
 
+// Set how long the caller waits for an EXECUTE
+void Message::setTimeout(const int& timeout) {
+    this->timeout = timeout;
+}
+
+// Set the registration flags of the located function
+void Message::setFunctionFlags(const int& function_flags) {
+    this->function_flags = function_flags;
+}
+
 // Set the reason code
 void Message::setReasonCode(const int& reason_code) {
     this->reason_code = reason_code;    
@@ -53,6 +112,9 @@ void Message::setReasonCode(const int& reason_code) {
 
 // Set the arg types
 void Message::setArgTypes(int* arg_types) {
+    // Clean up previous args
+    cleanup();
+
     this->num_args = args::numArgs(arg_types);
     this->arg_types = new int[this->num_args + 1];
     copyArgTypes(this->arg_types, arg_types);
@@ -71,6 +133,98 @@ void Message::setArgs(void** args) {
     copyArgs(this->args, args, arg_types);
 }
 
+// Set a list of locations
+// Locations are sent as args in pairs
+// First arg is the identifier, second arg is the port
+void Message::setLocations(const vector<pair<string, int>>& locations) {
+    const int num_args = locations.size() * 2;
+    unique_ptr<int[]> arg_types(new int[num_args + 1]);
+    unique_ptr<void*[]> args(new void*[num_args]);
+
+    for (int i = 0; i < num_args; i += 2) {
+        const auto& location = locations[i / 2];
+        arg_types[i] = (ARG_CHAR << 16) | (location.first.length() + 1);
+        arg_types[i + 1] = (ARG_INT << 16);
+        args[i] = (void*)location.first.c_str();
+        args[i + 1] = (void*)&location.second;
+    }
+    arg_types[num_args] = 0;
+
+    setArgTypes(arg_types.get());
+    setArgs(args.get());
+}
+
+// Set a list of server locations along with their numeric addresses
+// Each address follows the host name in the same char arg, after its
+// null terminator, so getLocations still reads the host name alone
+void Message::setLocations(const vector<pair<string, int>>& locations,
+    const vector<string>& addresses) {
+
+    vector<pair<string, int>> named;
+    for (size_t i = 0; i < locations.size(); ++i) {
+        string name = locations[i].first;
+        if (i < addresses.size() && !addresses[i].empty()) {
+            name.push_back('\0');
+            name += addresses[i];
+        }
+        named.push_back(make_pair(name, locations[i].second));
+    }
+
+    setLocations(named);
+}
+
+// Set a list of functions to register
+// Registrations are sent as args in pairs
+// First arg is the function name, second arg is its null terminated arg types
+void Message::setRegistrations(const vector<pair<string, vector<int>>>& registrations) {
+    setRegistrations(registrations, vector<int>());
+}
+
+// Set a list of functions to register along with their flags
+// The flags travel as one trailing int array arg, after the pairs
+void Message::setRegistrations(const vector<pair<string, vector<int>>>& registrations,
+    const vector<int>& function_flags) {
+    const int num_pairs = registrations.size() * 2;
+    const int num_args = num_pairs + (function_flags.empty() ? 0 : 1);
+    unique_ptr<int[]> arg_types(new int[num_args + 1]);
+    unique_ptr<void*[]> args(new void*[num_args]);
+
+    for (int i = 0; i < num_pairs; i += 2) {
+        const auto& registration = registrations[i / 2];
+        arg_types[i] = (ARG_CHAR << 16) | (registration.first.length() + 1);
+        arg_types[i + 1] = (ARG_INT << 16) | registration.second.size();
+        args[i] = (void*)registration.first.c_str();
+        args[i + 1] = (void*)registration.second.data();
+    }
+    if (num_args > num_pairs) {
+        arg_types[num_pairs] = (ARG_INT << 16) | function_flags.size();
+        args[num_pairs] = (void*)function_flags.data();
+    }
+    arg_types[num_args] = 0;
+
+    setArgTypes(arg_types.get());
+    setArgs(args.get());
+}
+
+// Set a list of ints, sent as a single int array arg
+void Message::setIntArray(const vector<int>& values) {
+    int arg_types[2] = {(ARG_INT << 16) | (int)values.size(), 0};
+    void* args[1] = {(void*)values.data()};
+
+    setArgTypes(arg_types);
+    setArgs(args);
+}
+
+// Set one reason code per registration
+void Message::setReasonCodes(const vector<int>& reason_codes) {
+    setIntArray(reason_codes);
+}
+
+// Set the server load statistics, indexed by LoadStat
+void Message::setLoad(const vector<int>& load) {
+    setIntArray(load);
+}
+
 // Get the message type
 MessageType Message::getType() const {
     return type;    
@@ -86,6 +240,11 @@ const char* Message::getServerIdentifier() const {
     return server_identifier;
 }
 
+// Get the numeric address of the server, empty if unknown
+const char* Message::getAddress() const {
+    return address;
+}
+
 // Get the server port                                            
 int Message::getPort() const {
     return port;    
@@ -96,6 +255,16 @@ int Message::getReasonCode() const {
     return reason_code;
 }
 
+// Get how long the caller waits for an EXECUTE
+int Message::getTimeout() const {
+    return timeout;
+}
+
+// Get the registration flags of the located function
+int Message::getFunctionFlags() const {
+    return function_flags;
+}
+
 // Get the argument types
 int* Message::getArgTypes() const {
     return arg_types;    
@@ -106,6 +275,74 @@ void** Message::getArgs() const {
     return args;    
 }
 
+// Get the list of locations
+vector<pair<string, int>> Message::getLocations() const {
+    vector<pair<string, int>> locations;
+    for (int i = 0; i + 1 < num_args; i += 2) {
+        locations.push_back(make_pair((char*)args[i], *(int*)args[i + 1]));
+    }
+
+    return locations;
+}
+
+// Get the numeric address of each location, empty if it was not sent
+vector<string> Message::getAddresses() const {
+    vector<string> addresses;
+    for (int i = 0; i + 1 < num_args; i += 2) {
+        const char* name = (char*)args[i];
+        const size_t name_length = strlen(name) + 1;
+        const size_t length = arrayLen(arg_types[i]);
+        addresses.push_back(name_length < length ?
+            string(name + name_length, strnlen(name + name_length, length - name_length)) : string());
+    }
+
+    return addresses;
+}
+
+// Get the list of functions to register
+vector<pair<string, vector<int>>> Message::getRegistrations() const {
+    vector<pair<string, vector<int>>> registrations;
+    for (int i = 0; i + 1 < num_args; i += 2) {
+        const int* types = (int*)args[i + 1];
+        vector<int> registration_types(types, types + arrayLen(arg_types[i + 1]));
+        registrations.push_back(make_pair((char*)args[i], registration_types));
+    }
+
+    return registrations;
+}
+
+// Get the flags of each function to register, 0 for any that were not sent
+vector<int> Message::getRegistrationFlags() const {
+    vector<int> function_flags(num_args / 2, 0);
+    if (num_args % 2 == 1) {
+        const int* values = (int*)args[num_args - 1];
+        const int count = min((int)function_flags.size(), arrayLen(arg_types[num_args - 1]));
+        copy(values, values + count, function_flags.begin());
+    }
+
+    return function_flags;
+}
+
+// Get a list of ints sent as a single int array arg
+vector<int> Message::getIntArray() const {
+    if (num_args == 0) {
+        return vector<int>();
+    }
+
+    const int* values = (int*)args[0];
+    return vector<int>(values, values + arrayLen(arg_types[0]));
+}
+
+// Get the reason code of every registration
+vector<int> Message::getReasonCodes() const {
+    return getIntArray();
+}
+
+// Get the server load statistics, indexed by LoadStat
+vector<int> Message::getLoad() const {
+    return getIntArray();
+}
+
 // Get the length of the message (in bytes)
 int Message::getLength() const {
     return length;    
@@ -129,11 +366,26 @@ void Message::recvServerIdentifier() {
     parse(server_identifier, sizeof(server_identifier));
 }
 
+// Read the numeric address
+void Message::recvAddress() {
+    parse(address, sizeof(address));
+}
+
 // Read the server port
 void Message::recvPort() {
     parse(&port, sizeof(port));
 }
 
+// Read how long the caller waits
+void Message::recvTimeout() {
+    parse(&timeout, sizeof(timeout));
+}
+
+// Read the function flags
+void Message::recvFunctionFlags() {
+    parse(&function_flags, sizeof(function_flags));
+}
+
 // Read the function name
 void Message::recvName() {
     parse(name, sizeof(name));
@@ -177,12 +429,15 @@ void Message::recvHeader() {
 }
 
 // Read at most max_bytes from the given socket
-void Message::recvBytes(const int& socket, const int& max_bytes) {
+void Message::recvBytes(const int& socket, const int& max_bytes, const int& recv_flags) {
     const int buffer_size = max_bytes - total_bytes;
     char* buffer = raw_bytes.get() + total_bytes;
 
-    int num_bytes = recv(socket, buffer, buffer_size, 0);
-    if (num_bytes <= 0) {
+    int num_bytes = recv(socket, buffer, buffer_size, recv_flags);
+    if (num_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // Non-blocking socket with nothing to read yet
+        return;
+    } else if (num_bytes <= 0) {
         throw RecvError();
     }
     
@@ -191,12 +446,17 @@ void Message::recvBytes(const int& socket, const int& max_bytes) {
 
 // Non-blocking receive (may need to be called multiple times)
 void Message::recvNonBlock(const int& socket) {
+    recvSome(socket, 0);
+}
+
+// Receive what is available, passing recv_flags to recv
+void Message::recvSome(const int& socket, const int& recv_flags) {
     if ((flags & END_OF_HEADER) == 0) {
         if (raw_bytes.get() == nullptr) {
             raw_bytes.reset(new char[HEADER_SIZE]);
         }
 
-        recvBytes(socket, HEADER_SIZE);
+        recvBytes(socket, HEADER_SIZE, recv_flags);
         if (total_bytes < HEADER_SIZE) {
             return;
         }
@@ -214,7 +474,7 @@ void Message::recvNonBlock(const int& socket) {
     }
 
     if ((flags & END_OF_MESSAGE) == 0) {
-        recvBytes(socket, length); 
+        recvBytes(socket, length, recv_flags);
         if (total_bytes < length) {
             return;
         }
@@ -233,11 +493,24 @@ void Message::recvBlock(const int& socket) {
     }
 }
 
+// Block version of receive that gives up at the deadline
+void Message::recvBlock(const int& socket, const Deadline& deadline) {
+    while (!eom()) {
+        waitFor(socket, POLLIN, deadline);
+        recvSome(socket, MSG_DONTWAIT);
+    }
+}
+
 // End of message/all bytes received
 bool Message::eom() const {
     return flags & END_OF_MESSAGE;
 }
 
+// Any bytes of the message received
+bool Message::started() const {
+    return (flags & END_OF_HEADER) || total_bytes > 0;
+}
+
 // Receive/parse the message body
 void Message::recvMessage() {
     raw_index = 0;
@@ -261,12 +534,15 @@ void Message::recvMessage() {
         case LOC_SUCCESS:
             recvServerIdentifier();
             recvPort();
+            recvAddress();
+            recvFunctionFlags();
             break;
         case LOC_FAILURE:
             recvReasonCode();
             break;
         case EXECUTE:
             recvName();
+            recvTimeout();
             recvArgTypes();
             recvArgs();
             break;
@@ -283,9 +559,28 @@ void Message::recvMessage() {
             recvArgTypes();
             break;
         case LOC_CACHE_SUCCESS:
+            recvFunctionFlags();
+            recvArgTypes();
+            recvArgs();
+            break;
+        case SHARD_MAP_SUCCESS:
+        case REGISTER_BATCH_SUCCESS:
+        case HEARTBEAT:
+            recvArgTypes();
+            recvArgs();
+            break;
+        case REGISTER_BATCH:
+            recvServerIdentifier();
+            recvPort();
+            recvAddress();
             recvArgTypes();
             recvArgs();
             break;
+        case BINDER_JOIN:
+            recvServerIdentifier();
+            recvPort();
+            break;
+        case SHARD_MAP:
         case TERMINATE:
         case NONE:
         default:
@@ -297,7 +592,7 @@ void Message::recvMessage() {
 void Message::sendBytes(const int& socket, const void* buffer, const int& buffer_size) {
     int sent = 0;
     do {
-        int bytes = send(socket, (char*)buffer + sent, buffer_size - sent, 0);
+        int bytes = send(socket, (char*)buffer + sent, buffer_size - sent, MSG_NOSIGNAL);
         if (bytes < 0) {
             throw SendError();
         }
@@ -306,100 +601,177 @@ void Message::sendBytes(const int& socket, const void* buffer, const int& buffer
     while (sent != buffer_size);
 }
 
-// Send the server identifier
-void Message::sendServerIdentifier(const int& socket) {
-    sendBytes(socket, server_identifier, sizeof(server_identifier));
+// Append a number of bytes from the given buffer
+void Message::appendBytes(string& buffer, const void* src, const int& size) {
+    buffer.append((const char*)src, size);
+}
+
+// Encode the server identifier
+void Message::encodeServerIdentifier(string& buffer) const {
+    appendBytes(buffer, server_identifier, sizeof(server_identifier));
+}
+
+// Encode the numeric address
+void Message::encodeAddress(string& buffer) const {
+    appendBytes(buffer, address, sizeof(address));
+}
+
+// Encode the server port
+void Message::encodePort(string& buffer) const {
+    appendBytes(buffer, &port, sizeof(port));
+}
+
+// Encode how long the caller waits
+void Message::encodeTimeout(string& buffer) const {
+    appendBytes(buffer, &timeout, sizeof(timeout));
 }
 
-// Send the server port
-void Message::sendPort(const int& socket) {
-    sendBytes(socket, &port, sizeof(port));
+// Encode the function flags
+void Message::encodeFunctionFlags(string& buffer) const {
+    appendBytes(buffer, &function_flags, sizeof(function_flags));
 }
 
-// Send the function name
-void Message::sendName(const int& socket) {
-    sendBytes(socket, name, sizeof(name));
+// Encode the function name
+void Message::encodeName(string& buffer) const {
+    appendBytes(buffer, name, sizeof(name));
 }
 
-// Send the argument types
-void Message::sendArgTypes(const int& socket) {
-    // Send # of arguments and then send arg types without the null
-    sendBytes(socket, &num_args, sizeof(num_args));
-    sendBytes(socket, arg_types, num_args * sizeof(int));
+// Encode the argument types
+void Message::encodeArgTypes(string& buffer) const {
+    // Encode # of arguments and then the arg types without the null
+    appendBytes(buffer, &num_args, sizeof(num_args));
+    appendBytes(buffer, arg_types, num_args * sizeof(int));
 }
 
-// Send all arguments
-void Message::sendArgs(const int& socket) {
+// Encode all arguments
+void Message::encodeArgs(string& buffer) const {
     for (int i = 0; i < num_args; ++i) {
         int buffer_size = argSize(arg_types[i]);
-        sendBytes(socket, args[i], buffer_size);
+        appendBytes(buffer, args[i], buffer_size);
     }
 }
 
-// Send the reason code
-void Message::sendReasonCode(const int& socket) {
-    sendBytes(socket, &reason_code, sizeof(reason_code));
+// Encode the reason code
+void Message::encodeReasonCode(string& buffer) const {
+    appendBytes(buffer, &reason_code, sizeof(reason_code));
 }
 
-// Send the message header
-void Message::sendHeader(const int& socket) {
-    sendBytes(socket, &length, sizeof(length));
-    sendBytes(socket, &type, sizeof(type));
+// Encode the message header
+void Message::encodeHeader(string& buffer) const {
+    appendBytes(buffer, &length, sizeof(length));
+    appendBytes(buffer, &type, sizeof(type));
 }
 
-// Send the entire message (including header)
-void Message::sendMessage(const int& socket) {
-    sendHeader(socket);
+// Encode the entire message (including header)
+string Message::encode() const {
+    string buffer;
+    buffer.reserve(HEADER_SIZE + length);
+
+    encodeHeader(buffer);
     switch (type) {
         case REGISTER:
-            sendServerIdentifier(socket);
-            sendPort(socket);
-            sendName(socket);
-            sendArgTypes(socket);
+            encodeServerIdentifier(buffer);
+            encodePort(buffer);
+            encodeName(buffer);
+            encodeArgTypes(buffer);
             break;
         case REGISTER_SUCCESS:
-            sendReasonCode(socket);
+            encodeReasonCode(buffer);
             break;
         case REGISTER_FAILURE:
-            sendReasonCode(socket);
+            encodeReasonCode(buffer);
             break;
         case LOC_REQUEST:
-            sendName(socket);
-            sendArgTypes(socket);
+            encodeName(buffer);
+            encodeArgTypes(buffer);
             break;
         case LOC_SUCCESS:
-            sendServerIdentifier(socket);
-            sendPort(socket);
+            encodeServerIdentifier(buffer);
+            encodePort(buffer);
+            encodeAddress(buffer);
+            encodeFunctionFlags(buffer);
             break;
         case LOC_FAILURE:
-            sendReasonCode(socket);
+            encodeReasonCode(buffer);
             break;
         case EXECUTE:
-            sendName(socket);
-            sendArgTypes(socket);
-            sendArgs(socket);
+            encodeName(buffer);
+            encodeTimeout(buffer);
+            encodeArgTypes(buffer);
+            encodeArgs(buffer);
             break;
         case EXECUTE_SUCCESS:
-            sendName(socket);
-            sendArgTypes(socket);
-            sendArgs(socket);
+            encodeName(buffer);
+            encodeArgTypes(buffer);
+            encodeArgs(buffer);
             break;
         case EXECUTE_FAILURE:
-            sendReasonCode(socket);
+            encodeReasonCode(buffer);
             break;
         case LOC_CACHE:
-            sendName(socket);
-            sendArgTypes(socket);
+            encodeName(buffer);
+            encodeArgTypes(buffer);
             break;
         case LOC_CACHE_SUCCESS:
-            sendArgTypes(socket);
-            sendArgs(socket);
+            encodeFunctionFlags(buffer);
+            encodeArgTypes(buffer);
+            encodeArgs(buffer);
+            break;
+        case SHARD_MAP_SUCCESS:
+        case REGISTER_BATCH_SUCCESS:
+        case HEARTBEAT:
+            encodeArgTypes(buffer);
+            encodeArgs(buffer);
             break;
+        case REGISTER_BATCH:
+            encodeServerIdentifier(buffer);
+            encodePort(buffer);
+            encodeAddress(buffer);
+            encodeArgTypes(buffer);
+            encodeArgs(buffer);
+            break;
+        case BINDER_JOIN:
+            encodeServerIdentifier(buffer);
+            encodePort(buffer);
+            break;
+        case SHARD_MAP:
         case TERMINATE:
         case NONE:
         default:
             break;
     }
+
+    return buffer;
+}
+
+// Send the entire message (including header)
+void Message::sendMessage(const int& socket) {
+    sendEncoded(socket, encode());
+}
+
+// Send a message that was already encoded
+void Message::sendEncoded(const int& socket, const string& bytes) {
+    sendBytes(socket, bytes.data(), bytes.size());
+}
+
+// Send a message that was already encoded, giving up at the deadline
+void Message::sendEncoded(const int& socket, const string& bytes, const Deadline& deadline) {
+    if (deadline == Deadline::max()) {
+        sendBytes(socket, bytes.data(), bytes.size());
+        return;
+    }
+
+    size_t sent = 0;
+    while (sent < bytes.size()) {
+        waitFor(socket, POLLOUT, deadline);
+        int num_bytes = send(socket, bytes.data() + sent, bytes.size() - sent,
+            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (num_bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            throw SendError();
+        } else if (num_bytes > 0) {
+            sent += num_bytes;
+        }
+    }
 }
 
 // Recalulate the message length if arg types or message type change
@@ -421,12 +793,29 @@ void Message::recalculateLength() {
                 + sizeof(*arg_types) * num_args;
             break;
         case LOC_SUCCESS:
+            length = sizeof(server_identifier) + sizeof(port) + sizeof(address)
+                + sizeof(function_flags);
+            break;
+        case BINDER_JOIN:
             length = sizeof(server_identifier) + sizeof(port);
             break;
         case EXECUTE:
         case EXECUTE_SUCCESS:
             length = sizeof(name) + sizeof(num_args)
                 + sizeof(*arg_types) * num_args;
+            if (type == EXECUTE) {
+                length += sizeof(timeout);
+            }
+
+            // Add total arg size to length
+            for (int i = 0; i < num_args; ++i) {
+                length += argSize(arg_types[i]);
+            }
+
+            break;
+        case REGISTER_BATCH:
+            length = sizeof(server_identifier) + sizeof(port) + sizeof(address)
+                + sizeof(num_args) + sizeof(*arg_types) * num_args;
 
             // Add total arg size to length
             for (int i = 0; i < num_args; ++i) {
@@ -435,7 +824,13 @@ void Message::recalculateLength() {
 
             break;
         case LOC_CACHE_SUCCESS:
+        case SHARD_MAP_SUCCESS:
+        case REGISTER_BATCH_SUCCESS:
+        case HEARTBEAT:
             length = sizeof(num_args) + sizeof(*arg_types) * num_args;
+            if (type == LOC_CACHE_SUCCESS) {
+                length += sizeof(function_flags);
+            }
 
             // Add total arg size to length
             for (int i = 0; i < num_args; ++i) {
@@ -443,6 +838,7 @@ void Message::recalculateLength() {
             }
     
             break;
+        case SHARD_MAP:
         case TERMINATE:
         case NONE:
         default:
@@ -1,9 +1,11 @@
 #ifndef __MESSAGE_H__
 #define __MESSAGE_H__
 
+#include <chrono>
 #include <string>
 #include <memory>
 #include <utility>
+#include <vector>
 
 namespace message {
 
@@ -21,17 +23,43 @@ enum MessageType {
     EXECUTE,
     EXECUTE_SUCCESS,
     EXECUTE_FAILURE,
-    TERMINATE
+    TERMINATE,
+    BINDER_JOIN,
+    SHARD_MAP,
+    SHARD_MAP_SUCCESS,
+    REGISTER_BATCH,
+    REGISTER_BATCH_SUCCESS,
+    HEARTBEAT
 };
 
+// Server load statistics carried by heartbeats
+enum LoadStat {
+    LOAD_IN_FLIGHT,                     // Calls currently executing
+    LOAD_CONNECTIONS,                   // Open client connections
+    NUM_LOAD_STATS
+};
+
+// Time by which a call must complete, or Deadline::max() for none
+typedef std::chrono::steady_clock::time_point Deadline;
+
+// Milliseconds left until the deadline as poll takes them, -1 if there is none
+int remainingMs(const Deadline& deadline);
+
+// Whether a numeric address only reaches the host it is used on, so it
+// must never be handed to clients on other hosts
+bool isLoopback(const std::string& address);
+
 // Message
 class Message {
     int length;                         // The length of the message
     MessageType type;                   // The type of message
     char name[64];                      // The name of the machine/function
     char server_identifier[48];         // IP address or hostname
+    char address[48];                   // Numeric address of the server, if known
     int port;                           // The port number
     int reason_code;                    // The error code
+    int timeout;                        // Milliseconds the caller waits for an EXECUTE, 0 for no limit
+    int function_flags;                 // Registration flags of the located function, eg RPC_FUNCTION_PURE
     int num_args;                       // The number of args
     int* arg_types;                     // The types of args
     void** args;                        // The function arguments
@@ -56,58 +84,94 @@ public:
     struct PeekError {};
     struct SendError {};
     struct RecvError {};
+    struct TimeoutError {};
 
     // Send/receive a message
     void sendMessage(const int& socket);
+    std::string encode() const;
+    static void sendEncoded(const int& socket, const std::string& bytes);
+    static void sendEncoded(const int& socket, const std::string& bytes, const Deadline& deadline);
     void recvBlock(const int& socket);
+    void recvBlock(const int& socket, const Deadline& deadline);
     void recvNonBlock(const int& socket);
 
     // Setters
     void setType(const MessageType& type);
     void setName(const char* name);
     void setServerIdentifier(const char* identifier);
+    void setAddress(const char* address);
     void setPort(const int& port);
     void setReasonCode(const int& reason_code);
+    void setTimeout(const int& timeout);
+    void setFunctionFlags(const int& function_flags);
     void setArgTypes(int* arg_types);
     void setArgs(void** args);
+    void setLocations(const std::vector<std::pair<std::string, int>>& locations);
+    void setLocations(const std::vector<std::pair<std::string, int>>& locations,
+        const std::vector<std::string>& addresses);
+    void setRegistrations(const std::vector<std::pair<std::string, std::vector<int>>>& registrations);
+    void setRegistrations(const std::vector<std::pair<std::string, std::vector<int>>>& registrations,
+        const std::vector<int>& function_flags);
+    void setReasonCodes(const std::vector<int>& reason_codes);
+    void setLoad(const std::vector<int>& load);
 
     // Getters
     MessageType getType() const;
     const char* getName() const;
     const char* getServerIdentifier() const;
+    const char* getAddress() const;
     int getPort() const;
     int getReasonCode() const;
+    int getTimeout() const;
+    int getFunctionFlags() const;
     int* getArgTypes() const;
     void** getArgs() const;
+    std::vector<std::pair<std::string, int>> getLocations() const;
+    std::vector<std::string> getAddresses() const;
+    std::vector<std::pair<std::string, std::vector<int>>> getRegistrations() const;
+    std::vector<int> getRegistrationFlags() const;
+    std::vector<int> getReasonCodes() const;
+    std::vector<int> getLoad() const;
 
     int getLength() const;
     int numArgs() const;
     bool eom() const;
+    bool started() const;
 
 
 private:
     // Receiving helper functions
-    void recvBytes(const int& socket, const int& max_bytes);
+    void recvSome(const int& socket, const int& recv_flags);
+    void recvBytes(const int& socket, const int& max_bytes, const int& recv_flags);
     void recvHeader();
     void recvMessage();
     void recvName();
     void recvServerIdentifier();
+    void recvAddress();
     void recvPort();
     void recvReasonCode();
+    void recvTimeout();
+    void recvFunctionFlags();
     void recvArgTypes();
     void recvArgs();
 
     // Sending helper functions
-    void sendBytes(const int& socket, const void* buffer, const int& buffer_size);
-    void sendHeader(const int& socket);
-    void sendName(const int& socket);
-    void sendServerIdentifier(const int& socket);
-    void sendPort(const int& socket);
-    void sendReasonCode(const int& socket);
-    void sendArgTypes(const int& socket);
-    void sendArgs(const int& socket);
+    static void sendBytes(const int& socket, const void* buffer, const int& buffer_size);
+    static void appendBytes(std::string& buffer, const void* src, const int& size);
+    void encodeHeader(std::string& buffer) const;
+    void encodeName(std::string& buffer) const;
+    void encodeServerIdentifier(std::string& buffer) const;
+    void encodeAddress(std::string& buffer) const;
+    void encodePort(std::string& buffer) const;
+    void encodeReasonCode(std::string& buffer) const;
+    void encodeTimeout(std::string& buffer) const;
+    void encodeFunctionFlags(std::string& buffer) const;
+    void encodeArgTypes(std::string& buffer) const;
+    void encodeArgs(std::string& buffer) const;
 
     // Miscellaneous helper functions
+    void setIntArray(const std::vector<int>& values);
+    std::vector<int> getIntArray() const;
     void recalculateLength();
     void cleanup();
     void parse(void* dst, const int& buffer_size);
@@ -0,0 +1,140 @@
+#ifndef __PHASH_H__
+#define __PHASH_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace phash {
+
+// A read-only map from strings, built once with a minimal perfect hash
+// Keys are hashed into buckets, and each bucket gets a displacement that
+// moves its keys into free slots, so every key has a slot of its own and
+// there are exactly as many slots as keys. A lookup is one hash of the
+// key and one compare with the key in its slot, and since the table
+// never changes any number of threads may look up at once
+template <typename Value>
+class Table {
+    static const uint32_t MAX_DISPLACEMENT = 1 << 16;  // Tried per bucket before another seed
+
+    struct Slot {
+        uint64_t hash;
+        std::string key;
+        Value value;
+    };
+
+    uint64_t seed;
+    std::vector<uint32_t> displacements;    // By bucket
+    std::vector<Slot> slots;
+
+    // FNV-1a, with the seed mixed into the offset basis
+    static uint64_t hashKey(const std::string& key, uint64_t seed) {
+        uint64_t hash = 14695981039346656037ULL ^ seed;
+        for (unsigned char c : key) {
+            hash = (hash ^ c) * 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    // Where a key lands with a displacement, from the splitmix64 finalizer
+    static size_t slotOf(uint64_t hash, uint32_t displacement, size_t count) {
+        uint64_t x = hash + displacement * 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        return (x ^ (x >> 31)) % count;
+    }
+
+    // Place every key with this seed, returning false if some bucket has
+    // no displacement that fits, eg because two keys hash alike
+    bool place(const std::vector<std::pair<std::string, Value>>& entries) {
+        const size_t count = entries.size();
+        std::vector<uint64_t> hashes(count);
+        std::vector<std::vector<size_t>> buckets(count);
+        for (size_t i = 0; i < count; ++i) {
+            hashes[i] = hashKey(entries[i].first, seed);
+            buckets[hashes[i] % count].push_back(i);
+        }
+
+        // Fit the fullest buckets first, while most slots are free
+        std::vector<size_t> order(count);
+        for (size_t i = 0; i < count; ++i) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return buckets[a].size() > buckets[b].size();
+        });
+
+        displacements.assign(count, 0);
+        std::vector<bool> taken(count, false);
+        std::vector<size_t> placed(count);
+        for (size_t bucket : order) {
+            const auto& keys = buckets[bucket];
+            if (keys.empty()) {
+                break;
+            }
+
+            uint32_t displacement = 0;
+            for (;; ++displacement) {
+                if (displacement == MAX_DISPLACEMENT) {
+                    return false;
+                }
+
+                std::vector<size_t> chosen;
+                for (size_t key : keys) {
+                    const size_t slot = slotOf(hashes[key], displacement, count);
+                    if (taken[slot] || std::find(chosen.begin(), chosen.end(), slot) != chosen.end()) {
+                        break;
+                    }
+                    chosen.push_back(slot);
+                }
+
+                if (chosen.size() == keys.size()) {
+                    for (size_t i = 0; i < keys.size(); ++i) {
+                        taken[chosen[i]] = true;
+                        placed[keys[i]] = chosen[i];
+                    }
+                    break;
+                }
+            }
+            displacements[bucket] = displacement;
+        }
+
+        slots.assign(count, Slot());
+        for (size_t i = 0; i < count; ++i) {
+            slots[placed[i]] = Slot{hashes[i], entries[i].first, entries[i].second};
+        }
+        return true;
+    }
+
+public:
+    Table(): seed(0) {
+    }
+
+    // Build over entries, whose keys must be distinct
+    explicit Table(const std::vector<std::pair<std::string, Value>>& entries): seed(0) {
+        while (!entries.empty() && !place(entries)) {
+            ++seed;
+        }
+    }
+
+    // Get the value for a key, or nullptr if it has none
+    const Value* find(const std::string& key) const {
+        if (slots.empty()) {
+            return nullptr;
+        }
+
+        const uint64_t hash = hashKey(key, seed);
+        const Slot& slot = slots[slotOf(hash, displacements[hash % slots.size()], slots.size())];
+        return slot.hash == hash && slot.key == key ? &slot.value : nullptr;
+    }
+
+    size_t size() const {
+        return slots.size();
+    }
+};
+
+}
+
+#endif // __PHASH_H__
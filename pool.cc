@@ -0,0 +1,186 @@
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "codes.h"
+#include "pool.h"
+using namespace codes;
+using namespace std;
+
+namespace pool {
+
+Options::Options(): max_idle(8), max_total(64), idle_timeout(30000) {
+}
+
+// Read a positive integer from the environment, if it is set
+static void readEnv(const char* name, int& value) {
+    const char* str = getenv(name);
+    if (str != nullptr && atoi(str) > 0) {
+        value = atoi(str);
+    }
+}
+
+// Get the default options, overridden by the environment
+Options Options::fromEnv() {
+    Options options;
+    int idle_timeout = options.idle_timeout.count();
+
+    readEnv("RPC_POOL_MAX_IDLE", options.max_idle);
+    readEnv("RPC_POOL_MAX_TOTAL", options.max_total);
+    readEnv("RPC_POOL_IDLE_MS", idle_timeout);
+
+    options.idle_timeout = chrono::milliseconds(idle_timeout);
+    return options;
+}
+
+ConnectionPool::ConnectionPool(Connector connector, const Options& options):
+    connector(connector), options(options), last_sweep(chrono::steady_clock::now()) {
+}
+
+ConnectionPool::~ConnectionPool() {
+    for (auto& host : hosts) {
+        for (const auto& idle : host.second.idle) {
+            close(idle.socket);
+        }
+    }
+}
+
+// An idle connection should have nothing to read
+// If it does, the server closed it or broke the protocol
+bool ConnectionPool::healthy(int socket) {
+    char byte;
+    int bytes = recv(socket, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+    return bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Close the idle connections of a host that timed out
+void ConnectionPool::prune(Host& host, chrono::steady_clock::time_point now) {
+    while (!host.idle.empty() && now - host.idle.front().since >= options.idle_timeout) {
+        close(host.idle.front().socket);
+        host.idle.pop_front();
+        --host.total;
+    }
+}
+
+// Close timed out connections to every host, at most once per timeout
+void ConnectionPool::sweep(chrono::steady_clock::time_point now) {
+    if (now - last_sweep < options.idle_timeout) {
+        return;
+    }
+
+    for (auto& host : hosts) {
+        prune(host.second, now);
+    }
+    last_sweep = now;
+}
+
+int ConnectionPool::acquire(const Location& location, bool& reused, const Deadline& deadline) {
+    unique_lock<mutex> guard(lock);
+    auto& host = hosts[location];
+
+    for (;;) {
+        prune(host, chrono::steady_clock::now());
+
+        // Reuse the most recently used healthy connection
+        while (!host.idle.empty()) {
+            const int socket = host.idle.back().socket;
+            host.idle.pop_back();
+            if (healthy(socket)) {
+                reused = true;
+                return socket;
+            }
+
+            close(socket);
+            --host.total;
+        }
+
+        if (host.total < options.max_total) {
+            break;
+        }
+
+        if (deadline == Deadline::max()) {
+            available.wait(guard);
+        } else if (available.wait_until(guard, deadline) == cv_status::timeout) {
+            return ERROR_DEADLINE_EXCEEDED;
+        }
+    }
+
+    // Open a new connection without holding the lock
+    ++host.total;
+    guard.unlock();
+
+    const int socket = connector(location.first.c_str(), to_string(location.second).c_str(), deadline);
+    if (socket < 0) {
+        guard.lock();
+        --host.total;
+        available.notify_one();
+    }
+
+    reused = false;
+    return socket;
+}
+
+int ConnectionPool::acquireIdle(const Location& location) {
+    lock_guard<mutex> guard(lock);
+    auto& host = hosts[location];
+    prune(host, chrono::steady_clock::now());
+
+    while (!host.idle.empty()) {
+        const int socket = host.idle.back().socket;
+        host.idle.pop_back();
+        if (healthy(socket)) {
+            return socket;
+        }
+
+        close(socket);
+        --host.total;
+    }
+
+    return -1;
+}
+
+bool ConnectionPool::reserve(const Location& location) {
+    lock_guard<mutex> guard(lock);
+    auto& host = hosts[location];
+    if (host.total >= options.max_total) {
+        return false;
+    }
+
+    ++host.total;
+    return true;
+}
+
+void ConnectionPool::unreserve(const Location& location) {
+    lock_guard<mutex> guard(lock);
+    --hosts[location].total;
+    available.notify_one();
+}
+
+void ConnectionPool::release(const Location& location, int socket) {
+    lock_guard<mutex> guard(lock);
+    auto& host = hosts[location];
+    const auto now = chrono::steady_clock::now();
+
+    if ((int)host.idle.size() < options.max_idle) {
+        host.idle.push_back(Idle{socket, now});
+    } else {
+        close(socket);
+        --host.total;
+    }
+
+    sweep(now);
+    available.notify_one();
+}
+
+void ConnectionPool::discard(const Location& location, int socket) {
+    close(socket);
+
+    lock_guard<mutex> guard(lock);
+    --hosts[location].total;
+    available.notify_one();
+}
+
+}
@@ -0,0 +1,90 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace pool {
+
+typedef std::pair<std::string, int> Location;
+typedef std::chrono::steady_clock::time_point Deadline;
+
+// Opens a new connection by the deadline, returning the socket or a
+// negative error code
+typedef int (*Connector)(const char* host_name, const char* port, const Deadline& deadline);
+
+struct Options {
+    int max_idle;                               // Idle connections kept per location
+    int max_total;                              // Open connections allowed per location
+    std::chrono::milliseconds idle_timeout;     // How long an idle connection is kept
+
+    Options();
+    static Options fromEnv();
+};
+
+// Pool of connections to servers, keyed by location
+class ConnectionPool {
+    struct Idle {
+        int socket;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    struct Host {
+        std::deque<Idle> idle;  // Most recently used at the back
+        int total;              // Idle plus checked out
+
+        Host(): total(0) {
+        }
+    };
+
+    Connector connector;
+    Options options;
+    std::mutex lock;
+    std::condition_variable available;
+    std::map<Location, Host> hosts;
+    std::chrono::steady_clock::time_point last_sweep;
+
+public:
+    ConnectionPool(Connector connector, const Options& options);
+    ~ConnectionPool();
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    // Check out a connection, reusing a healthy idle one if there is one
+    // Waits while max_total connections to the location are checked out
+    // Returns the socket or a negative error code
+    int acquire(const Location& location, bool& reused,
+        const Deadline& deadline = Deadline::max());
+
+    // Check out a healthy idle connection without waiting or connecting
+    // Returns -1 if there is none
+    int acquireIdle(const Location& location);
+
+    // Take a slot for a connection the caller opens itself, so it counts
+    // against max_total and can be checked in or discarded like one from
+    // acquire. Returns false without waiting if every slot is taken
+    bool reserve(const Location& location);
+
+    // Give back a reserved slot whose connection failed to open
+    void unreserve(const Location& location);
+
+    // Check a connection back in once a full exchange completed on it
+    void release(const Location& location, int socket);
+
+    // Close a connection that failed
+    void discard(const Location& location, int socket);
+
+private:
+    static bool healthy(int socket);
+    void prune(Host& host, std::chrono::steady_clock::time_point now);
+    void sweep(std::chrono::steady_clock::time_point now);
+};
+
+}
+
+#endif // __POOL_H__
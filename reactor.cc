@@ -0,0 +1,258 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "codes.h"
+#include "reactor.h"
+using namespace std;
+using namespace codes;
+using namespace message;
+
+namespace reactor {
+
+// Idle connections outlive the clients' own idle timeout, so clients
+// usually close them first
+Options::Options(): reactors(max(1u, thread::hardware_concurrency())), backlog(SOMAXCONN),
+    idle_timeout(60000) {
+}
+
+// Get the default options, overridden by the environment
+Options Options::fromEnv() {
+    Options options;
+    const char* str = getenv("RPC_SERVER_REACTORS");
+    if (str != nullptr && atoi(str) > 0) {
+        options.reactors = atoi(str);
+    }
+    str = getenv("RPC_LISTEN_BACKLOG");
+    if (str != nullptr && atoi(str) > 0) {
+        options.backlog = atoi(str);
+    }
+    str = getenv("RPC_SERVER_IDLE_MS");
+    if (str != nullptr && atoi(str) > 0) {
+        options.idle_timeout = chrono::milliseconds(atoi(str));
+    }
+    return options;
+}
+
+int listenOn(const sockaddr* address, socklen_t length, int backlog) {
+    int socketfd = socket(address->sa_family, SOCK_STREAM, 0);
+    if (socketfd < 0) {
+        return ERROR_SOCKET_CREATE;
+    }
+
+    int on = 1;
+    setsockopt(socketfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    if (bind(socketfd, address, length) < 0) {
+        ::close(socketfd);
+        return ERROR_SOCKET_BIND;
+    }
+
+    if (listen(socketfd, backlog) < 0) {
+        ::close(socketfd);
+        return ERROR_SOCKET_LISTEN;
+    }
+
+    return socketfd;
+}
+
+Reactor::Reactor(int listener, chrono::milliseconds idle_timeout, Handler handler):
+    listener(listener), idle_timeout(idle_timeout), epollfd(-1), wakefd(-1), handler(handler), stopping(false) {
+}
+
+Reactor::~Reactor() {
+    stop();
+    close();
+}
+
+int Reactor::start() {
+    epollfd = epoll_create1(0);
+    wakefd = eventfd(0, EFD_NONBLOCK);
+    if (epollfd < 0 || wakefd < 0) {
+        return ERROR_SOCKET_CREATE;
+    }
+
+    // Accepts are batched until the listener would block
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = wakefd;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &event) < 0) {
+        return ERROR_SOCKET_CREATE;
+    }
+
+    event.data.fd = listener;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listener, &event) < 0) {
+        return ERROR_SOCKET_CREATE;
+    }
+
+    io_thread = thread(&Reactor::run, this);
+    return 0;
+}
+
+void Reactor::stop() {
+    stopping = true;
+    if (io_thread.joinable()) {
+        const unsigned long long one = 1;
+        if (write(wakefd, &one, sizeof(one)) == sizeof(one)) {
+            io_thread.join();
+        } else {
+            io_thread.detach();
+        }
+    }
+}
+
+void Reactor::close() {
+    lock_guard<mutex> guard(lock);
+    for (const auto& client : clients) {
+        ::close(client.first);
+    }
+    clients.clear();
+    requests.clear();
+
+    for (int* socketfd : {&listener, &epollfd, &wakefd}) {
+        if (*socketfd >= 0) {
+            ::close(*socketfd);
+            *socketfd = -1;
+        }
+    }
+}
+
+void Reactor::rearm(int client) {
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = clients.find(client);
+        if (it != clients.end()) {
+            it->second = chrono::steady_clock::now();
+        }
+    }
+
+    // One-shot, so the connection is handed to one thread per request
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = client;
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, client, &event) < 0) {
+        discard(client);
+    }
+}
+
+void Reactor::discard(int client) {
+    lock_guard<mutex> guard(lock);
+    if (clients.erase(client) > 0) {
+        ::close(client);
+    }
+}
+
+int Reactor::connections() {
+    lock_guard<mutex> guard(lock);
+    return clients.size();
+}
+
+void Reactor::run() {
+    // Idle connections are looked for a few times per idle timeout
+    const int sweep_interval = max(idle_timeout.count() / 4, 10L);
+    auto next_sweep = chrono::steady_clock::now() + chrono::milliseconds(sweep_interval);
+
+    epoll_event events[64];
+    while (!stopping) {
+        int ready = epoll_wait(epollfd, events, 64, sweep_interval);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (int i = 0; i < ready && !stopping; ++i) {
+            const int socketfd = events[i].data.fd;
+            if (socketfd == listener) {
+                acceptBatch();
+            } else if (socketfd != wakefd) {
+                read(socketfd);
+            }
+        }
+
+        if (chrono::steady_clock::now() >= next_sweep) {
+            closeIdle();
+            next_sweep = chrono::steady_clock::now() + chrono::milliseconds(sweep_interval);
+        }
+    }
+}
+
+// Accept the connections waiting on the listener, up to a batch
+void Reactor::acceptBatch() {
+    for (int i = 0; i < ACCEPT_BATCH; ++i) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            return;
+        }
+
+        {
+            lock_guard<mutex> guard(lock);
+            clients[client] = chrono::steady_clock::now();
+        }
+
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.fd = client;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, client, &event) < 0) {
+            discard(client);
+        }
+    }
+}
+
+// Read what has arrived of a connection's request, handing it on once complete
+void Reactor::read(int client) {
+    auto& msg = requests[client];
+    if (msg == nullptr) {
+        msg.reset(new Message());
+    }
+
+    try {
+        msg->recvNonBlock(client);
+    } catch(...) {
+        // Usually end up here if the connection closed
+        requests.erase(client);
+        discard(client);
+        return;
+    }
+
+    if (!msg->eom()) {
+        rearm(client);
+        return;
+    }
+
+    // Busy connections are never idle, however long the call takes
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = clients.find(client);
+        if (it != clients.end()) {
+            it->second = Time::max();
+        }
+    }
+
+    unique_ptr<Message> request(move(msg));
+    requests.erase(client);
+    handler(*this, client, move(request));
+}
+
+// Close connections that have been idle for too long, along with
+// any request they left half sent
+void Reactor::closeIdle() {
+    const auto now = chrono::steady_clock::now();
+    lock_guard<mutex> guard(lock);
+    for (auto it = clients.begin(); it != clients.end();) {
+        if (it->second == Time::max() || now - it->second < idle_timeout) {
+            ++it;
+            continue;
+        }
+
+        ::close(it->first);
+        requests.erase(it->first);
+        it = clients.erase(it);
+    }
+}
+
+}
@@ -0,0 +1,97 @@
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <sys/socket.h>
+
+#include "message.h"
+
+namespace reactor {
+
+struct Options {
+    int reactors;                   // Threads accepting and reading requests, the core count by default
+    int backlog;                    // Connections each listener queues before they are accepted
+    std::chrono::milliseconds idle_timeout;     // How long an idle connection is kept open
+
+    Options();
+    static Options fromEnv();
+};
+
+// Open a socket listening on the address, which other listeners may share
+// with SO_REUSEPORT, returning it or a negative error code
+int listenOn(const sockaddr* address, socklen_t length, int backlog);
+
+class Reactor;
+
+// Called on the reactor thread with each complete request
+// The handler owns the connection until it calls rearm or discard
+typedef std::function<void(Reactor& reactor, int client,
+    std::unique_ptr<message::Message> msg)> Handler;
+
+// Accepts connections from one listening socket and reads requests from
+// them on its own thread and epoll set
+// Several reactors share the server's port, and the kernel spreads new
+// connections between their listeners. A connection is only watched
+// while no request of its is being handled, so replies need no locking.
+// Connections serve any number of requests in turn, and are closed when
+// the client closes them or they have been idle for idle_timeout
+class Reactor {
+    typedef std::chrono::steady_clock::time_point Time;
+
+    static const int ACCEPT_BATCH = 64;     // Connections accepted per wakeup
+
+    int listener;
+    std::chrono::milliseconds idle_timeout;
+    int epollfd;
+    int wakefd;                             // eventfd to stop the thread
+    Handler handler;
+    std::thread io_thread;
+    std::atomic<bool> stopping;
+
+    // Reactor thread only
+    std::unordered_map<int, std::unique_ptr<message::Message>> requests;   // Partly read, by socket
+
+    std::mutex lock;                        // Guards clients
+    std::unordered_map<int, Time> clients;  // Every open connection, by when it
+                                            // went idle, or Time::max() while busy
+
+public:
+    Reactor(int listener, std::chrono::milliseconds idle_timeout, Handler handler);
+    ~Reactor();
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    // Start the thread, returning 0 or a negative error code
+    int start();
+
+    // Stop reading requests and wait for the thread
+    void stop();
+
+    // Close the listener and every connection, once stopped
+    void close();
+
+    // Watch a connection for its next request, from any thread
+    void rearm(int client);
+
+    // Close a connection, from any thread
+    void discard(int client);
+
+    int connections();
+
+private:
+    void run();
+    void acceptBatch();
+    void read(int client);
+    void closeIdle();
+};
+
+}
+
+#endif // __REACTOR_H__
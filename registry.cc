@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "registry.h"
+using namespace std;
+
+namespace registry {
+
+static const char MAGIC[8] = {'R', 'P', 'C', 'R', 'E', 'G', '1', '\n'};
+
+// Fixed part of every record, followed by the host name and signature
+struct RecordHeader {
+    int type;
+    int port;
+    int name_length;
+    int signature_length;
+};
+
+Registry::Registry(): fd(-1), snapshot_records(0), log_records(0) {
+}
+
+Registry::~Registry() {
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+bool Registry::isOpen() const {
+    return fd != -1;
+}
+
+// Map the file, replay every record into state, then compact it
+// A missing file is treated as an empty registry
+bool Registry::open(const string& path, State& state) {
+    this->path = path;
+
+    int readfd = ::open(path.c_str(), O_RDONLY);
+    if (readfd != -1) {
+        struct stat info;
+        if (fstat(readfd, &info) == 0 && info.st_size > 0) {
+            void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, readfd, 0);
+            if (data != MAP_FAILED) {
+                replay((const char*)data, info.st_size, state);
+                munmap(data, info.st_size);
+            }
+        }
+        close(readfd);
+    }
+
+    return compact(state);
+}
+
+// Apply records in order, stopping at the first one that is cut short
+// since that is where a crashed binder stopped writing
+void Registry::replay(const char* data, size_t size, State& state) {
+    if (size < sizeof(MAGIC) || memcmp(data, MAGIC, sizeof(MAGIC)) != 0) {
+        return;
+    }
+
+    size_t offset = sizeof(MAGIC);
+    while (offset + sizeof(RecordHeader) <= size) {
+        RecordHeader header;
+        memcpy(&header, data + offset, sizeof(header));
+        offset += sizeof(header);
+
+        if (header.name_length < 0 || header.signature_length < 0
+            || offset + header.name_length + header.signature_length > size) {
+            break;
+        }
+
+        const Location location(string(data + offset, header.name_length), header.port);
+        offset += header.name_length;
+        const string signature(data + offset, header.signature_length);
+        offset += header.signature_length;
+
+        if (header.type == ADD) {
+            state[location].insert(signature);
+        } else if (header.type == REMOVE) {
+            state.erase(location);
+        }
+    }
+}
+
+// Write a single record to the given file
+// Returns false unless the whole record was written
+bool Registry::append(int fd, RecordType type, const Location& location,
+    const string& signature) {
+
+    RecordHeader header;
+    header.type = type;
+    header.port = location.second;
+    header.name_length = location.first.length();
+    header.signature_length = signature.length();
+
+    // Build the record first so it reaches the file in one write
+    string record((const char*)&header, sizeof(header));
+    record += location.first;
+    record += signature;
+
+    // On failure the in-memory registry stays correct, it just won't
+    // survive a restart
+    return write(fd, record.data(), record.length()) == (ssize_t)record.length();
+}
+
+void Registry::add(const Location& location, const string& signature) {
+    if (fd != -1) {
+        append(fd, ADD, location, signature);
+        ++log_records;
+    }
+}
+
+void Registry::remove(const Location& location) {
+    if (fd != -1) {
+        append(fd, REMOVE, location, "");
+        ++log_records;
+    }
+}
+
+bool Registry::needsCompaction() const {
+    return log_records > max(1024, 2 * snapshot_records);
+}
+
+// Write the snapshot to a temporary file and rename it over the old one
+// so a crash or failed write during compaction leaves the previous
+// file intact
+bool Registry::compact(const State& state) {
+    const string temp_path = path + ".tmp";
+    int tempfd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (tempfd == -1) {
+        return false;
+    }
+
+    int records = 0;
+    bool ok = write(tempfd, MAGIC, sizeof(MAGIC)) == sizeof(MAGIC);
+    for (const auto& server : state) {
+        for (const auto& signature : server.second) {
+            ok = ok && append(tempfd, ADD, server.first, signature);
+            ++records;
+        }
+    }
+
+    if (!ok || fsync(tempfd) != 0 || rename(temp_path.c_str(), path.c_str()) != 0) {
+        close(tempfd);
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+
+    fd = tempfd;
+    snapshot_records = records;
+    log_records = 0;
+    return true;
+}
+
+}
@@ -0,0 +1,57 @@
+#ifndef __REGISTRY_H__
+#define __REGISTRY_H__
+
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <utility>
+
+namespace registry {
+
+typedef std::pair<std::string, int> Location;
+typedef std::map<Location, std::unordered_set<std::string>> State;
+
+// On-disk copy of the binder's registry
+// The file starts with a snapshot of every registration and has
+// changes appended to it as a log. It is memory-mapped and replayed
+// on startup, then compacted into a fresh snapshot.
+class Registry {
+    int fd;                 // Descriptor the log is appended through
+    std::string path;       // Location of the registry file
+    int snapshot_records;   // Number of records in the last snapshot
+    int log_records;        // Number of records appended since
+
+    enum RecordType {
+        ADD = 1,            // A server registered a function
+        REMOVE = 2,         // A server and all its functions left
+    };
+
+public:
+    Registry();
+    ~Registry();
+    Registry(const Registry&) = delete;
+    Registry& operator=(const Registry&) = delete;
+
+    // Load the registry at path into state and start logging to it
+    bool open(const std::string& path, State& state);
+    bool isOpen() const;
+
+    // Log changes to the registry
+    void add(const Location& location, const std::string& signature);
+    void remove(const Location& location);
+
+    // Whether the log has grown enough to be worth compacting
+    bool needsCompaction() const;
+
+    // Rewrite the file as a snapshot of the given state
+    bool compact(const State& state);
+
+private:
+    void replay(const char* data, size_t size, State& state);
+    bool append(int fd, RecordType type, const Location& location,
+        const std::string& signature);
+};
+
+}
+
+#endif // __REGISTRY_H__
@@ -0,0 +1,102 @@
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "codes.h"
+#include "resolve.h"
+using namespace codes;
+using namespace std;
+
+namespace resolve {
+
+Options::Options(): ttl(30000), negative_ttl(1000) {
+}
+
+// Read a positive integer from the environment, if it is set
+static void readEnv(const char* name, chrono::milliseconds& value) {
+    const char* str = getenv(name);
+    if (str != nullptr && atoi(str) > 0) {
+        value = chrono::milliseconds(atoi(str));
+    }
+}
+
+// Get the default options, overridden by the environment
+Options Options::fromEnv() {
+    Options options;
+    readEnv("RPC_RESOLVE_TTL_MS", options.ttl);
+    readEnv("RPC_RESOLVE_NEGATIVE_TTL_MS", options.negative_ttl);
+    return options;
+}
+
+Resolver::Resolver(const Options& options): options(options) {
+}
+
+int Resolver::resolve(const string& host, const string& port, Address& address) {
+    const auto key = make_pair(host, port);
+    const auto now = chrono::steady_clock::now();
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = entries.find(key);
+        if (it != entries.end() && it->second.expires > now) {
+            address = it->second.address;
+            return it->second.status;
+        }
+    }
+
+    // Look the host up without holding the lock
+    Entry entry;
+    memset(&entry.address, 0, sizeof(entry.address));
+    entry.status = 0;
+
+    addrinfo host_info, *host_info_list;
+    memset(&host_info, 0, sizeof host_info);
+    host_info.ai_family = AF_UNSPEC;
+    host_info.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host.c_str(), port.c_str(), &host_info, &host_info_list) != 0) {
+        entry.status = ERROR_ADDRINFO;
+        entry.expires = now + options.negative_ttl;
+    } else {
+        memcpy(&entry.address.storage, host_info_list->ai_addr, host_info_list->ai_addrlen);
+        entry.address.length = host_info_list->ai_addrlen;
+        entry.address.family = host_info_list->ai_family;
+        entry.expires = now + options.ttl;
+        freeaddrinfo(host_info_list);
+    }
+
+    lock_guard<mutex> guard(lock);
+    entries[key] = entry;
+    address = entry.address;
+    return entry.status;
+}
+
+void Resolver::prime(const string& host, const string& port, const string& numeric) {
+    Entry entry;
+    memset(&entry.address, 0, sizeof(entry.address));
+    entry.status = 0;
+
+    const int port_number = htons(atoi(port.c_str()));
+    auto* ipv4 = (sockaddr_in*)&entry.address.storage;
+    auto* ipv6 = (sockaddr_in6*)&entry.address.storage;
+    if (inet_pton(AF_INET, numeric.c_str(), &ipv4->sin_addr) == 1) {
+        ipv4->sin_family = AF_INET;
+        ipv4->sin_port = port_number;
+        entry.address.length = sizeof(*ipv4);
+    } else if (inet_pton(AF_INET6, numeric.c_str(), &ipv6->sin6_addr) == 1) {
+        ipv6->sin6_family = AF_INET6;
+        ipv6->sin6_port = port_number;
+        entry.address.length = sizeof(*ipv6);
+    } else {
+        return;
+    }
+    entry.address.family = entry.address.storage.ss_family;
+    entry.expires = chrono::steady_clock::now() + options.ttl;
+
+    lock_guard<mutex> guard(lock);
+    entries[make_pair(host, port)] = entry;
+}
+
+}
@@ -0,0 +1,58 @@
+#ifndef __RESOLVE_H__
+#define __RESOLVE_H__
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <sys/socket.h>
+
+namespace resolve {
+
+// A resolved socket address
+struct Address {
+    sockaddr_storage storage;
+    socklen_t length;
+    int family;
+};
+
+struct Options {
+    std::chrono::milliseconds ttl;              // How long a resolved address is reused
+    std::chrono::milliseconds negative_ttl;     // How long a failed lookup is remembered
+
+    Options();
+    static Options fromEnv();
+};
+
+// Cache of resolved addresses by host and port, so getaddrinfo runs
+// once per TTL rather than once per connection
+class Resolver {
+    struct Entry {
+        int status;                             // 0 or the error getaddrinfo caused
+        Address address;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    Options options;
+    std::mutex lock;
+    std::map<std::pair<std::string, std::string>, Entry> entries;
+
+public:
+    explicit Resolver(const Options& options);
+    Resolver(const Resolver&) = delete;
+    Resolver& operator=(const Resolver&) = delete;
+
+    // Resolve a host and port, from the cache while the entry is fresh
+    // Returns 0 or ERROR_ADDRINFO
+    int resolve(const std::string& host, const std::string& port, Address& address);
+
+    // Remember the numeric address the binder sent for a host, so it
+    // does not need to be looked up
+    void prime(const std::string& host, const std::string& port, const std::string& numeric);
+};
+
+}
+
+#endif // __RESOLVE_H__
@@ -17,14 +17,41 @@ extern "C" {
 #define ARG_INPUT   31
 #define ARG_OUTPUT  30
 
+// Function flags for rpcRegisterWithFlags
+#define RPC_FUNCTION_PURE   0x1     // Outputs depend only on the inputs, so clients may memoize
+#define RPC_FUNCTION_FAST   0x2     // Short and never blocks, so the server may run it inline
+
+// Priority classes for rpcSetLimits
+#define RPC_PRIORITY_HIGH   0
+#define RPC_PRIORITY_NORMAL 1
+#define RPC_PRIORITY_LOW    2
+
 
 typedef int (*skeleton)(int *, void **);
+typedef int (*batch_skeleton)(int, int *, void **);
+typedef void (*rpcCallback)(void *, int);
+typedef void (*rpcReducer)(void *, int, int *, void **);
 
 extern int rpcInit();
 extern int rpcCall(char* name, int* argTypes, void** args);
 extern int rpcCacheCall(char* name, int* argTypes, void** args);
+extern int rpcSetIdempotent(char* name, int* argTypes);
+extern int rpcSetTimeout(int milliseconds);
+extern void rpcHedgeStats(long* calls, long* hedged, long* wins);
+extern void rpcMemoStats(long* hits, long* misses);
+extern int rpcCallAsync(char* name, int* argTypes, void** args, int* handle);
+extern int rpcWait(int handle);
+extern int rpcPoll(int handle, int* status);
+extern int rpcWaitAny(int* handles, int count, int* index);
+extern int rpcCallCallback(char* name, int* argTypes, void** args, rpcCallback callback, void* context);
+extern int rpcCallAll(char* name, int* argTypes, void** args, rpcReducer reducer, void* context);
 extern int rpcRegister(char* name, int* argTypes, skeleton f);
+extern int rpcRegisterWithFlags(char* name, int* argTypes, skeleton f, int flags);
+extern int rpcRegisterBatch(char* name, int* argTypes, batch_skeleton f);
+extern int rpcSetLimits(char* name, int* argTypes, int maxConcurrent, int maxQueued, int priority);
+extern int rpcRegisterFlush();
 extern int rpcExecute();
+extern int rpcWorkerStats(int* queued, long* steals, int count);
 extern int rpcTerminate();
 
 #ifdef __cplusplus
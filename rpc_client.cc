@@ -3,28 +3,69 @@
  *
  * This implements the client-side RPC library.
  */
+#include <chrono>
+#include <cerrno>
 #include <cstring>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
-#include <netdb.h>
 #include <unistd.h>
-#include <unordered_map>
 #include <vector>
 
 #include "args.h"
+#include "async.h"
+#include "balance.h"
+#include "cache.h"
 #include "rpc.h"
 #include "codes.h"
+#include "flight.h"
+#include "hedge.h"
+#include "memo.h"
 #include "message.h"
+#include "pool.h"
+#include "resolve.h"
+#include "shard.h"
 using namespace std;
 using namespace message;
 using namespace codes;
 using namespace args;
+using namespace shard;
 
-typedef pair<string, int> Location;
-unordered_map<string, vector<Location>> cache;
+// A kept-alive connection to one binder
+// Requests on it are serialized by its lock
+struct BinderSession {
+    mutex lock;
+    int socket;
 
-int connectToBinder() {
+    BinderSession(): socket(-1) {
+    }
+};
+
+cache::LocationCache location_cache(cache::Options::fromEnv());
+balance::Balancer balancer;             // Picks which cached location to call
+hedge::Policy hedging(hedge::Options::fromEnv());
+memo::ResultCache results(memo::Options::fromEnv());     // Results of pure functions
+flight::Group<cache::Locations> lookups;    // LOC_CACHE requests in flight, by signature
+flight::Group<string> calls;                // Idempotent calls in flight, by args::callKey
+ShardMap shards;
+map<Location, unique_ptr<BinderSession>> sessions;
+mutex shards_mutex;     // Guards shards and sessions
+
+resolve::Resolver resolver(resolve::Options::fromEnv());
+
+int connectToServer(const char* host_name, const char* port, const Deadline& deadline);
+pool::ConnectionPool connections(connectToServer, pool::Options::fromEnv());
+async::Engine engine(connections, resolver);    // Runs rpcCallAsync calls
+thread_local chrono::milliseconds call_timeout(0);     // Set by rpcSetTimeout, 0 for none
+
+// Connect to the binder named by the environment
+int connectToBinder(const Deadline& deadline) {
     // Get environment variables
     const char* binder_addr = getenv("BINDER_ADDRESS");
     const char* binder_port = getenv("BINDER_PORT");
@@ -32,121 +73,379 @@ int connectToBinder() {
         return ERROR_MISSING_ENV;    
     }
 
-    // Initialization and setup
-    int status;
-    addrinfo host_info, *host_info_list;
-    memset(&host_info, 0, sizeof host_info);
+    return connectToServer(binder_addr, binder_port, deadline);
+}
 
-    host_info.ai_family = AF_UNSPEC;
-    host_info.ai_socktype = SOCK_STREAM;
+int connectToServer(const char* host_name, const char* port, const Deadline& deadline) {
 
-    // Getaddrinfo for binder, return error if fails
-    status = getaddrinfo(binder_addr, binder_port, &host_info, &host_info_list);
-    if (status != 0) {
-        return ERROR_ADDRINFO;
+    // Resolve the server, usually from the cache, return error if fails
+    resolve::Address address;
+    int status = resolver.resolve(host_name, port, address);
+    if (status < 0) {
+        return status;
     }
 
-    // Create binder socket, return error if fails
-    int binder_socket;
-    binder_socket = socket(host_info_list->ai_family, host_info_list->ai_socktype, host_info_list->ai_protocol);
-    if (binder_socket == -1) {
+    // Create server socket, return error if fails
+    int server_socket;
+    server_socket = socket(address.family, SOCK_STREAM, 0);
+    if (server_socket == -1) {
         return ERROR_SOCKET_CREATE;
     }
 
-    // Connect to binder socket, return error if fails
-    status = connect(binder_socket, host_info_list->ai_addr, host_info_list->ai_addrlen);
-    freeaddrinfo(host_info_list);
+    // Connect to server socket, return error if fails
+    // With a deadline, connect without blocking and wait until it passes
+    if (deadline != Deadline::max()) {
+        fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL, 0) | O_NONBLOCK);
+    }
+    status = connect(server_socket, (sockaddr*)&address.storage, address.length);
+    if (status == -1 && errno == EINPROGRESS) {
+        pollfd pfd;
+        pfd.fd = server_socket;
+        pfd.events = POLLOUT;
+
+        int error = 0;
+        socklen_t len = sizeof(error);
+        status = poll(&pfd, 1, remainingMs(deadline));
+        if (status == 0) {
+            close(server_socket);
+            return ERROR_DEADLINE_EXCEEDED;
+        }
+        if (status < 0 || getsockopt(server_socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            status = -1;
+        }
+    }
     if (status == -1) {
-        close(binder_socket);
+        close(server_socket);
         return ERROR_SOCKET_CONNECT;
     }
+    if (deadline != Deadline::max()) {
+        fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL, 0) & ~O_NONBLOCK);
+    }
 
-    // Return binder socket
-    return binder_socket;
+    // Return server socket
+    return server_socket;
 }
 
-int connectToServer(const char* host_name, const char* port) {
+// Ask the binder on the socket for the shard map, then close the socket
+int requestShardMap(int binder_socket, const Deadline& deadline, ShardMap& latest) {
+    if (binder_socket < 0) {
+        return binder_socket;
+    }
+
+    Message msg;
+    msg.setType(MessageType::SHARD_MAP);
 
-    // Initialization and setup
-    int status;
-    addrinfo host_info, *host_info_list;
-    memset(&host_info, 0, sizeof host_info);
+    try {
+        Message::sendEncoded(binder_socket, msg.encode(), deadline);
+        msg.recvBlock(binder_socket, deadline);
+    } catch (Message::SendError) {
+        close(binder_socket);
+        return ERROR_MESSAGE_SEND;
+    } catch (Message::RecvError) {
+        close(binder_socket);
+        return ERROR_MESSAGE_RECV;
+    } catch (Message::TimeoutError) {
+        close(binder_socket);
+        return ERROR_DEADLINE_EXCEEDED;
+    }
 
-    host_info.ai_family = AF_UNSPEC;
-    host_info.ai_socktype = SOCK_STREAM;
+    close(binder_socket);
+    latest = ShardMap(msg.getLocations());
+    return latest.empty() ? ERROR_MISSING_FUNCTION : 0;
+}
 
-    // Getaddrinfo for server, return error if fails
-    status = getaddrinfo(host_name, port, &host_info, &host_info_list);
-    if (status != 0) {
-        return ERROR_ADDRINFO;
+// Fetch the shard map from the binder named by the environment
+// The map is fetched once and reused until refreshShardMap replaces it
+int loadShardMap(const Deadline& deadline) {
+    {
+        lock_guard<mutex> lock(shards_mutex);
+        if (!shards.empty()) {
+            return 0;
+        }
     }
 
-    // Create server socket, return error if fails
-    int server_socket;
-    server_socket = socket(host_info_list->ai_family, host_info_list->ai_socktype, host_info_list->ai_protocol);
-    if (server_socket == -1) {
-        return ERROR_SOCKET_CREATE;
+    ShardMap latest;
+    int status = requestShardMap(connectToBinder(deadline), deadline, latest);
+    if (status < 0) {
+        return status;
     }
 
-    // Connect to server socket, return error if fails
-    status = connect(server_socket, host_info_list->ai_addr, host_info_list->ai_addrlen);
-    freeaddrinfo(host_info_list);
-    if (status == -1) {
-        close(server_socket);
-        return ERROR_SOCKET_CONNECT;
+    lock_guard<mutex> lock(shards_mutex);
+    if (shards.empty()) {
+        shards = latest;
     }
+    return 0;
+}
 
-    // Return server socket
-    return server_socket;
+// Fetch the shard map again, after a binder joined or left the cluster
+// If the binder named by the environment is gone, any other binder
+// we know of can answer
+// The map is fetched without holding shards_mutex, so lookups by
+// other threads carry on meanwhile
+int refreshShardMap(const Deadline& deadline) {
+    vector<Location> known;
+    {
+        lock_guard<mutex> lock(shards_mutex);
+        known = shards.all();
+    }
+
+    ShardMap latest;
+    int status = requestShardMap(connectToBinder(deadline), deadline, latest);
+    for (size_t i = 0; status < 0 && status != ERROR_DEADLINE_EXCEEDED && i < known.size(); ++i) {
+        status = requestShardMap(connectToServer(known[i].first.c_str(),
+            to_string(known[i].second).c_str(), deadline), deadline, latest);
+    }
+
+    if (status < 0) {
+        return status;
+    }
+
+    lock_guard<mutex> lock(shards_mutex);
+    shards = latest;
+    return 0;
 }
 
-int callServer(const char* identifier, const char* port, const char* name,
-    int* argTypes, void** args) {
+// Get the session for the given binder, creating it if needed
+BinderSession& getSession(const Location& location) {
+    lock_guard<mutex> lock(shards_mutex);
+    auto& session = sessions[location];
+    if (session == nullptr) {
+        session.reset(new BinderSession());
+    }
+
+    return *session;
+}
 
-    // Connect to serever
-    int server_socket = connectToServer(identifier, port);
-    if (server_socket < 0) {
-        return server_socket;
+// Send an encoded request to a binder over its kept-alive session
+// and, if reply is given, receive the binder's reply into it
+// A request that fails on a reused connection is retried once on a
+// new one, since the binder may have restarted or dropped it
+// A request still unanswered at the deadline closes the connection,
+// since the late reply would otherwise be read by the next request
+int binderRequest(const Location& location, const string& request,
+    unique_ptr<Message>* reply, const Deadline& deadline) {
+
+    auto& session = getSession(location);
+    lock_guard<mutex> lock(session.lock);
+
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        const bool reused = session.socket >= 0;
+        if (!reused) {
+            session.socket = connectToServer(location.first.c_str(),
+                to_string(location.second).c_str(), deadline);
+            if (session.socket < 0) {
+                int status = session.socket;
+                session.socket = -1;
+                return status;
+            }
+        }
+
+        int status = 0;
+        try {
+            Message::sendEncoded(session.socket, request, deadline);
+            if (reply != nullptr) {
+                reply->reset(new Message());
+                (*reply)->recvBlock(session.socket, deadline);
+            }
+            return 0;
+        } catch (Message::SendError) {
+            status = ERROR_MESSAGE_SEND;
+        } catch (Message::RecvError) {
+            status = ERROR_MESSAGE_RECV;
+        } catch (Message::TimeoutError) {
+            close(session.socket);
+            session.socket = -1;
+            return ERROR_DEADLINE_EXCEEDED;
+        }
+
+        close(session.socket);
+        session.socket = -1;
+        if (!reused) {
+            return status;
+        }
     }
 
-    // Create EXECUTE message
+    return ERROR_MESSAGE_RECV;
+}
+
+// Send a request to the binder that owns the given signature
+int binderRequest(const string& signature, const Message& request,
+    unique_ptr<Message>& reply, const Deadline& deadline) {
+
+    int status = loadShardMap(deadline);
+    if (status < 0) {
+        return status;
+    }
+
+    Location location;
+    {
+        lock_guard<mutex> lock(shards_mutex);
+        location = shards.owner(signature);
+    }
+
+    const string encoded = request.encode();
+    status = binderRequest(location, encoded, &reply, deadline);
+    if (status == ERROR_DEADLINE_EXCEEDED || (status >= 0 &&
+            !(reply->getType() == MessageType::LOC_FAILURE &&
+            reply->getReasonCode() == ERROR_MOVED_FUNCTION))) {
+        return status;
+    }
+
+    // The binder is gone or says it no longer owns the signature, so a
+    // binder joined or left since the map was fetched. Try once more
+    // with the owner in the latest map
+    if (refreshShardMap(deadline) < 0) {
+        return status;
+    }
+
+    Location owner;
+    {
+        lock_guard<mutex> lock(shards_mutex);
+        owner = shards.owner(signature);
+    }
+
+    return owner == location ? status : binderRequest(owner, encoded, &reply, deadline);
+}
+
+// The deadline of a call started now, from the thread's timeout
+Deadline callDeadline() {
+    if (call_timeout.count() == 0) {
+        return Deadline::max();
+    }
+    return chrono::steady_clock::now() + call_timeout;
+}
+
+// Encode an EXECUTE request, telling the server how long the caller waits
+string encodeExecute(const char* name, int* argTypes, void** args, const Deadline& deadline) {
     Message executeMsg;
     executeMsg.setType(MessageType::EXECUTE);
     executeMsg.setName(name);
+    executeMsg.setTimeout(max(remainingMs(deadline), 0));
     executeMsg.setArgTypes(argTypes);
     executeMsg.setArgs(args);
+    return executeMsg.encode();
+}
 
-    // Attempt to send EXECUTE message to server, and recv reply
-    // If either fails, return appropriate error
-    try {
-        executeMsg.sendMessage(server_socket);
-        executeMsg.recvBlock(server_socket);
-    } catch (Message::SendError) {
-        close(server_socket);
-        return ERROR_MESSAGE_SEND;
-    } catch (Message::RecvError) {
-        close(server_socket);
-        return ERROR_MESSAGE_RECV;
+int callServer(const Location& location, const char* name,
+    int* argTypes, void** args, const Deadline& deadline) {
+
+    // Create EXECUTE message
+    const string request = encodeExecute(name, argTypes, args, deadline);
+
+    bool retried = false;
+    for (;;) {
+        // Get a pooled connection to the server
+        bool reused = false;
+        int server_socket = connections.acquire(location, reused, deadline);
+        if (server_socket < 0) {
+            return server_socket;
+        }
+
+        // Attempt to send EXECUTE message to server
+        // A pooled connection may have been closed by the server since
+        // it was checked in, so retry on another connection
+        try {
+            Message::sendEncoded(server_socket, request, deadline);
+        } catch (Message::SendError) {
+            connections.discard(location, server_socket);
+            if (reused) {
+                continue;
+            }
+            return ERROR_MESSAGE_SEND;
+        } catch (Message::TimeoutError) {
+            connections.discard(location, server_socket);
+            return ERROR_DEADLINE_EXCEEDED;
+        }
+
+        // Recv reply
+        // A server closing an idle pooled connection can race with our
+        // send, and then the connection ends before any of the reply, so
+        // that is retried once on another connection. Once part of the
+        // reply arrived the call ran, so other failures are never retried
+        Message reply;
+        try {
+            if (deadline == Deadline::max()) {
+                reply.recvBlock(server_socket);
+            } else {
+                reply.recvBlock(server_socket, deadline);
+            }
+        } catch (Message::RecvError) {
+            connections.discard(location, server_socket);
+            if (reused && !retried && !reply.started()) {
+                retried = true;
+                continue;
+            }
+            return ERROR_MESSAGE_RECV;
+        } catch (Message::TimeoutError) {
+            connections.discard(location, server_socket);
+            return ERROR_DEADLINE_EXCEEDED;
+        }
+
+        // The exchange completed, so the connection can be reused
+        connections.release(location, server_socket);
+
+        // If server replies with EXECUTE_SUCCESS, copy arguments to args and argTypes
+        if (reply.getType() == MessageType::EXECUTE_SUCCESS) {
+            copyArgTypes(argTypes, reply.getArgTypes());
+            copyArgs(args, reply.getArgs(), reply.getArgTypes());
+            return 0;
+        }
+
+        return reply.getReasonCode();
     }
+}
 
-    // If server replies with EXECUTE_SUCCESS, copy arguments to args and argTypes
-    if (executeMsg.getType() == MessageType::EXECUTE_SUCCESS) {
-        copyArgTypes(argTypes, executeMsg.getArgTypes());
-        copyArgs(args, executeMsg.getArgs(), executeMsg.getArgTypes());
-        executeMsg.setReasonCode(0);
+// Answer a call to a pure function from the result cache, otherwise
+// keep its memo key so that remember can store the result
+bool recall(const string& key, int* argTypes, void** args, string& memo_key) {
+    if (!memo_key.empty() || !results.pure(key)) {
+        return false;
     }
 
-    // Close socket
-    close(server_socket);
-    return executeMsg.getReasonCode();
+    memo_key = callKey(key, argTypes, args);
+    return results.lookup(memo_key, argTypes, args);
 }
 
-int rpcCall(char* name, int* argTypes, void** args) {
+// Cache the result of a call to a pure function
+int remember(int status, const string& memo_key, int* argTypes, void** args) {
+    if (status == 0 && !memo_key.empty()) {
+        results.store(memo_key, argTypes, args);
+    }
+    return status;
+}
 
-    // Connect to binder
-    int binder_socket = connectToBinder();
-    if (binder_socket < 0) {
-        return binder_socket;
+// Share one request among identical concurrent calls to an idempotent
+// function, copying the outputs of the call that ran to the others
+int coalesce(const string& key, int* argTypes, void** args, const Deadline& deadline,
+    const function<int()>& call) {
+
+    if (!hedging.idempotent(key)) {
+        return call();
+    }
+
+    string outputs;
+    bool shared;
+    int status = calls.run(callKey(key, argTypes, args), [&](string& result) {
+        int status = call();
+        if (status == 0) {
+            result = packOutputs(argTypes, args);
+        }
+        return status;
+    }, outputs, shared, deadline);
+
+    if (shared && status == 0) {
+        unpackOutputs(args, argTypes, outputs);
+    }
+    return status;
+}
+
+int locateAndCall(char* name, int* argTypes, void** args, const string& key,
+    const Deadline& deadline) {
+
+    // Pure functions called before need not reach the binder at all
+    string memo_key;
+    if (recall(key, argTypes, args, memo_key)) {
+        return 0;
     }
 
     // Create LOC_REQUEST message
@@ -155,51 +454,46 @@ int rpcCall(char* name, int* argTypes, void** args) {
     msg.setName(name);
     msg.setArgTypes(argTypes);
 
-    // Send LOC_REQUEST message to the binder
-    // Recv reply from the binder
-    // If either fails, close socket and return appropriate error
-    try {
-        msg.sendMessage(binder_socket);
-        msg.recvBlock(binder_socket);
-    } catch (Message::SendError) {
-        close(binder_socket);
-        return ERROR_MESSAGE_SEND;
-    } catch (Message::RecvError) {
-        close(binder_socket);
-        return ERROR_MESSAGE_RECV;
+    // Send LOC_REQUEST message to the binder that owns this function
+    // and recv its reply over the kept-alive session
+    unique_ptr<Message> reply;
+    int status = binderRequest(key, msg, reply, deadline);
+    if (status < 0) {
+        return status;
     }
 
-    // If binder returns LOC_FAILURE, close socket and return error code
-    if (msg.getType() == MessageType::LOC_FAILURE) {
-        close(binder_socket);
-        return msg.getReasonCode();
+    // If binder returns LOC_FAILURE, return error code
+    if (reply->getType() == MessageType::LOC_FAILURE) {
+        return reply->getReasonCode();
+    }
+
+    results.setPure(key, reply->getFunctionFlags() & RPC_FUNCTION_PURE);
+    if (recall(key, argTypes, args, memo_key)) {
+        return 0;
     }
 
     // Now that we have the server info from the binder reply,
     // call the server using this info
-    close(binder_socket);
-    return callServer(msg.getServerIdentifier(),
-        to_string(msg.getPort()).c_str(), name, argTypes, args);
+    const Location location(reply->getServerIdentifier(), reply->getPort());
+    if (reply->getAddress()[0] != '\0') {
+        resolver.prime(location.first, to_string(location.second), reply->getAddress());
+    }
+    return remember(callServer(location, name, argTypes, args, deadline),
+        memo_key, argTypes, args);
 }
 
-int rpcCacheCall(char* name, int* argTypes, void** args) {
-
+int rpcCall(char* name, int* argTypes, void** args) {
+    const Deadline deadline = callDeadline();
     const string key = getSignature(name, argTypes);
-    auto& list = cache[key];
-
-    // Already cached, so call server with pairs of args from list
-    for (const auto& location : list) {
-        if (callServer(location.first.c_str(), to_string(location.second).c_str(),
-            name, argTypes, args) == 0) {
-            return 0;
-        }
-    }
+    return coalesce(key, argTypes, args, deadline, [&] {
+        return locateAndCall(name, argTypes, args, key, deadline);
+    });
+}
 
-    // Connect to binder
-    int binder_socket = connectToBinder();
-    if (binder_socket < 0) {
-        return binder_socket;
-    }
+// Fetch every location of a function from the binder that owns it
+// and cache them
+int lookupLocations(char* name, int* argTypes, const string& key, const Deadline& deadline,
+    cache::Locations& list) {
 
     // Create LOC_CACHE message
     Message msg;
@@ -207,65 +501,331 @@ int rpcCacheCall(char* name, int* argTypes, void** args) {
     msg.setName(name);
     msg.setArgTypes(argTypes);
 
-    // Send LOC_CACHE message to the binder
-    // Recv reply from the binder
-    // If either fails, close socket and return appropriate error
-    try {
-        msg.sendMessage(binder_socket);
-        msg.recvBlock(binder_socket);
-    } catch(Message::SendError) {
-        close(binder_socket);
-        return ERROR_MESSAGE_SEND;
-    } catch(Message::RecvError) {
-        close(binder_socket);
-        return ERROR_MESSAGE_RECV;
+    // Send LOC_CACHE message to the binder that owns this function
+    // and recv its reply over the kept-alive session
+    unique_ptr<Message> reply;
+    int status = binderRequest(key, msg, reply, deadline);
+    if (status < 0) {
+        return status;
     }
 
-    // Close socket, and if binder replied with LOC_FAILURE, return error
-    close(binder_socket);
-    if (msg.getType() == MessageType::LOC_FAILURE) {
-        return msg.getReasonCode();
+    // If binder replied with LOC_FAILURE, forget any stale locations
+    // and return error
+    if (reply->getType() == MessageType::LOC_FAILURE) {
+        location_cache.erase(key);
+        return reply->getReasonCode();
+    }
+
+    // Parsing locations from binder reply
+    // Their numeric addresses save resolving each host name
+    auto locations = reply->getLocations();
+    const auto addresses = reply->getAddresses();
+    for (size_t i = 0; i < locations.size(); ++i) {
+        if (!addresses[i].empty()) {
+            resolver.prime(locations[i].first, to_string(locations[i].second), addresses[i]);
+        }
     }
+    list = location_cache.put(key, move(locations));
+    results.setPure(key, reply->getFunctionFlags() & RPC_FUNCTION_PURE);
+    return 0;
+}
 
-    list.clear();
-    // Parsing args from binder reply
-    auto msg_args = msg.getArgs();
-    for (int i = 0; i < msg.numArgs(); i += 2) {
-        list.push_back(make_pair((char*)msg_args[i], *(int*)(msg_args[i + 1])));
+// Concurrent lookups of the same function share one LOC_CACHE request,
+// which gives up at the deadline of the call that sent it
+int fetchLocations(char* name, int* argTypes, const string& key, const Deadline& deadline,
+    cache::Locations& list) {
+    bool shared;
+    return lookups.run(key, [&](cache::Locations& result) {
+        return lookupLocations(name, argTypes, key, deadline, result);
+    }, list, shared);
+}
+
+// Whether a call failed because the server could not be reached
+bool unreachable(int status) {
+    return status == ERROR_ADDRINFO || status == ERROR_SOCKET_CREATE ||
+        status == ERROR_SOCKET_CONNECT || status == ERROR_MESSAGE_SEND ||
+        status == ERROR_MESSAGE_RECV || status == ERROR_DEADLINE_EXCEEDED;
+}
+
+// Call the locations in the order the balancer prefers until one
+// succeeds or the deadline passes
+int callLocations(const vector<Location>& list, const char* name,
+    int* argTypes, void** args, const Deadline& deadline) {
+
+    int ret = ERROR_MISSING_FUNCTION;
+    for (const auto& location : balancer.order(list)) {
+        balance::Time started = balancer.start(location);
+        int status = callServer(location, name, argTypes, args, deadline);
+        balancer.finish(location, started, !unreachable(status));
+        if (status == 0 || status == ERROR_DEADLINE_EXCEEDED) {
+            return status;
+        }
+
+        // Report overload rather than a missing function if every server is busy
+        if (status == ERROR_SERVER_BUSY || status == ERROR_FUNCTION_BUSY) {
+            ret = status;
+        }
     }
-    
+
+    return ret;
+}
+
+// Call an idempotent function through the I/O thread, sending it to a
+// second location too if the first is slower than usual
+int hedgedCall(const string& key, const vector<Location>& list, chrono::milliseconds delay,
+    const char* name, int* argTypes, void** args, const Deadline& deadline) {
+
+    const auto started = chrono::steady_clock::now();
+    int handle = engine.submit(balancer.order(list), encodeExecute(name, argTypes, args, deadline),
+        argTypes, args, deadline, delay);
+    if (handle < 0) {
+        return handle;
+    }
+
+    int status = engine.wait(handle);
+    if (status == 0) {
+        hedging.record(key, chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now() - started));
+    }
+    return status;
+}
+
+int cacheCall(char* name, int* argTypes, void** args, const string& key,
+    const Deadline& deadline) {
+
+    // Pure functions called before need not reach any server
+    string memo_key;
+    if (recall(key, argTypes, args, memo_key)) {
+        return 0;
+    }
+
+    cache::Locations list = location_cache.get(key);
+
+    chrono::milliseconds delay;
+    const bool idempotent = hedging.idempotent(key, delay);
+
+    // Already cached, so call server with pairs of args from list
+    if (list) {
+        int status = idempotent ?
+            hedgedCall(key, *list, delay, name, argTypes, args, deadline) :
+            callLocations(*list, name, argTypes, args, deadline);
+        if (status == 0 || status == ERROR_DEADLINE_EXCEEDED) {
+            return remember(status, memo_key, argTypes, args);
+        }
+    }
+
+    int status = fetchLocations(name, argTypes, key, deadline, list);
+    if (status < 0) {
+        return status;
+    }
+
+    // The binder may have just said the function is pure
+    if (recall(key, argTypes, args, memo_key)) {
+        return 0;
+    }
+
     // call server using the pairs of args from list
-    for (const auto& location : list) {
-        if (callServer(location.first.c_str(), to_string(location.second).c_str(),
-            name, argTypes, args) == 0) {
-            return 0;
+    return remember(idempotent ?
+        hedgedCall(key, *list, delay, name, argTypes, args, deadline) :
+        callLocations(*list, name, argTypes, args, deadline),
+        memo_key, argTypes, args);
+}
+
+int rpcCacheCall(char* name, int* argTypes, void** args) {
+    const Deadline deadline = callDeadline();
+    const string key = getSignature(name, argTypes);
+    return coalesce(key, argTypes, args, deadline, [&] {
+        return cacheCall(name, argTypes, args, key, deadline);
+    });
+}
+
+int rpcSetTimeout(int milliseconds) {
+    call_timeout = chrono::milliseconds(max(milliseconds, 0));
+    return 0;
+}
+
+int rpcSetIdempotent(char* name, int* argTypes) {
+    hedging.markIdempotent(getSignature(name, argTypes));
+    return 0;
+}
+
+void rpcHedgeStats(long* calls, long* hedged, long* wins) {
+    engine.hedgeStats(*calls, *hedged, *wins);
+}
+
+void rpcMemoStats(long* hits, long* misses) {
+    results.stats(*hits, *misses);
+}
+
+// Find the locations of a function and encode its EXECUTE request
+int prepareCall(char* name, int* argTypes, void** args, const Deadline& deadline,
+    vector<Location>& locations, string& request) {
+
+    // Locations come from the cache, asking the binder on a miss
+    const string key = getSignature(name, argTypes);
+    cache::Locations list = location_cache.get(key);
+    if (!list) {
+        int status = fetchLocations(name, argTypes, key, deadline, list);
+        if (status < 0) {
+            return status;
+        }
+    }
+    locations = balancer.order(*list);
+
+    // Create EXECUTE message
+    request = encodeExecute(name, argTypes, args, deadline);
+    return 0;
+}
+
+int rpcCallAsync(char* name, int* argTypes, void** args, int* handle) {
+    const Deadline deadline = callDeadline();
+    vector<Location> locations;
+    string request;
+    int status = prepareCall(name, argTypes, args, deadline, locations, request);
+    if (status < 0) {
+        return status;
+    }
+
+    // The I/O thread sends it and fills in args when the reply arrives
+    status = engine.submit(locations, request, argTypes, args, deadline);
+    if (status < 0) {
+        return status;
+    }
+
+    *handle = status;
+    return 0;
+}
+
+int rpcCallCallback(char* name, int* argTypes, void** args,
+    rpcCallback callback, void* context) {
+
+    const Deadline deadline = callDeadline();
+    vector<Location> locations;
+    string request;
+    int status = prepareCall(name, argTypes, args, deadline, locations, request);
+    if (status < 0) {
+        return status;
+    }
+
+    return engine.submit(locations, request, argTypes, args, callback, context, deadline);
+}
+
+// A private copy of a call's args, so that the replies of many
+// servers can be received at once
+struct ArgsCopy {
+    vector<int> arg_types;
+    vector<unique_ptr<char[]>> buffers;
+    vector<void*> args;
+
+    ArgsCopy(int* arg_types, void** args):
+        arg_types(arg_types, arg_types + numArgs(arg_types) + 1) {
+
+        for (int i = 0; i < numArgs(arg_types); ++i) {
+            const int size = argSize(arg_types[i]);
+            buffers.emplace_back(new char[size]);
+            memcpy(buffers.back().get(), args[i], size);
+            this->args.push_back(buffers.back().get());
+        }
+    }
+};
+
+// Call every server exporting a function at once, passing each one's
+// status and outputs to reducer on this thread as its reply arrives
+// Returns 0 if every server succeeded, otherwise the first error
+int rpcCallAll(char* name, int* argTypes, void** args, rpcReducer reducer, void* context) {
+    const Deadline deadline = callDeadline();
+    const string key = getSignature(name, argTypes);
+    cache::Locations list = location_cache.get(key);
+    if (!list) {
+        int status = fetchLocations(name, argTypes, key, deadline, list);
+        if (status < 0) {
+            return status;
+        }
+    }
+
+    const string request = encodeExecute(name, argTypes, args, deadline);
+    vector<unique_ptr<ArgsCopy>> copies;
+    vector<int> handles;
+    vector<ArgsCopy*> pending;     // The copy each handle fills in
+    int ret = 0;
+
+    auto reduce = [&](int status, ArgsCopy& copy) {
+        if (status < 0 && ret == 0) {
+            ret = status;
+        }
+        reducer(context, status, copy.arg_types.data(), copy.args.data());
+    };
+
+    for (const auto& location : *list) {
+        copies.emplace_back(new ArgsCopy(argTypes, args));
+        ArgsCopy& copy = *copies.back();
+        int handle = engine.submit(vector<Location>(1, location), request,
+            copy.arg_types.data(), copy.args.data(), deadline);
+        if (handle < 0) {
+            reduce(handle, copy);
+            continue;
+        }
+
+        handles.push_back(handle);
+        pending.push_back(&copy);
+    }
+
+    // Reduce replies in the order they arrive
+    while (!handles.empty()) {
+        int index;
+        int status = engine.waitAny(handles.data(), handles.size(), index);
+        if (index < 0) {
+            return status;
         }
+
+        reduce(status, *pending[index]);
+        handles[index] = handles.back();
+        handles.pop_back();
+        pending[index] = pending.back();
+        pending.pop_back();
     }
 
-    return ERROR_MISSING_FUNCTION;
+    return ret;
+}
+
+int rpcWait(int handle) {
+    return engine.wait(handle);
+}
+
+int rpcPoll(int handle, int* status) {
+    return engine.poll(handle, *status);
+}
+
+int rpcWaitAny(int* handles, int count, int* index) {
+    return engine.waitAny(handles, count, *index);
 }
 
 int rpcTerminate() {
+    int status = loadShardMap(Deadline::max());
+    if (status < 0) {
+        return status;
+    }
+
+    vector<Location> binders;
+    {
+        lock_guard<mutex> lock(shards_mutex);
+        binders = shards.all();
+    }
+
     // Create TERMINATE message
     Message msg;
     msg.setType(MessageType::TERMINATE);
 
-    // Connect to binder
-    int binder_socket = connectToBinder();
-    if (binder_socket < 0) {
-        return binder_socket;
-    }
-
-    // Send TERMINATE message to binder
-    // If sending fails, close socket and return error
-    try {
-        msg.sendMessage(binder_socket); 
-    } catch(Message::SendError) {
-        close(binder_socket);
-        return ERROR_MESSAGE_SEND;
+    // Every binder in the cluster tells its own servers to terminate
+    // If sending fails, remember the error and carry on
+    const string request = msg.encode();
+    int ret = 0;
+    for (const auto& binder : binders) {
+        int status = binderRequest(binder, request, nullptr, Deadline::max());
+        if (status < 0) {
+            ret = status;
+        }
     }
 
-    // Close socket
-    close(binder_socket);
-    return 0;
+    return ret;
 }
@@ -0,0 +1,103 @@
+/*
+ * rpc_coro.h
+ *
+ * This defines the C++20 coroutine interface to the client-side RPC library.
+ *
+ *     int status = co_await rpc::call(executor, name, argTypes, args);
+ *
+ * suspends the calling coroutine until the server replies, without
+ * holding a thread. The call runs on the library's I/O thread and the
+ * coroutine is resumed through executor.post, or on the I/O thread
+ * itself when no executor is given. argTypes and args must stay valid
+ * until the coroutine resumes.
+ */
+#ifndef __RPC_CORO_H__
+#define __RPC_CORO_H__
+
+#if __cplusplus < 202002L
+#error "rpc_coro.h requires C++20"
+#endif
+
+#include <concepts>
+#include <coroutine>
+#include <functional>
+
+#include "rpc.h"
+
+namespace rpc {
+
+// Anything that can run a function later, eg a thread pool or event loop
+// Executors are copied into each call, so they should be cheap handles
+template <typename Executor>
+concept executor = std::copy_constructible<Executor> &&
+    requires(Executor& e, std::function<void()> f) {
+        e.post(std::move(f));
+    };
+
+// Resumes coroutines straight away on the I/O thread
+struct InlineExecutor {
+    void post(std::function<void()> f) const {
+        f();
+    }
+};
+
+template <executor Executor>
+class CallAwaiter {
+    Executor executor;
+    char* name;
+    int* arg_types;
+    void** args;
+    int status;
+    std::coroutine_handle<> waiting;
+
+    static void resume(void* context, int status) {
+        // The coroutine may finish with the awaiter before post returns,
+        // so post through a copy of the executor
+        auto* self = static_cast<CallAwaiter*>(context);
+        Executor executor = self->executor;
+        auto waiting = self->waiting;
+        self->status = status;
+        executor.post([waiting] { waiting.resume(); });
+    }
+
+public:
+    CallAwaiter(Executor executor, char* name, int* arg_types, void** args):
+        executor(std::move(executor)), name(name), arg_types(arg_types),
+        args(args), status(0) {
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> coroutine) {
+        waiting = coroutine;
+
+        // Once submitted the coroutine may resume on another thread at any
+        // time, so this must not be touched afterwards
+        int submitted = rpcCallCallback(name, arg_types, args, &CallAwaiter::resume, this);
+        if (submitted < 0) {
+            status = submitted;
+            return false;
+        }
+        return true;
+    }
+
+    // Returns the same status rpcCall would
+    int await_resume() const noexcept {
+        return status;
+    }
+};
+
+template <executor Executor>
+CallAwaiter<Executor> call(Executor executor, char* name, int* argTypes, void** args) {
+    return CallAwaiter<Executor>(std::move(executor), name, argTypes, args);
+}
+
+inline CallAwaiter<InlineExecutor> call(char* name, int* argTypes, void** args) {
+    return CallAwaiter<InlineExecutor>(InlineExecutor(), name, argTypes, args);
+}
+
+}
+
+#endif // __RPC_CORO_H__
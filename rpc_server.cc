@@ -4,9 +4,16 @@
  * This implements the server-side RPC library.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <thread>
 #include <unordered_map>
 #include <vector>
 #include <iostream>
@@ -21,31 +28,110 @@
 #include "args.h"
 #include "codes.h"
 #include "message.h"
+#include "phash.h"
+#include "reactor.h"
 #include "rpc.h"
+#include "shard.h"
+#include "workers.h"
 
 #define SOCK_INVALID -1
 using namespace args;
 using namespace codes;
 using namespace message;
+using namespace shard;
 using namespace std;
 
-static int binder_socket = SOCK_INVALID;
+static ShardMap shards;
+static map<Location, int> binder_sockets;
+
+// Binders may push a new shard map or a termination request while we
+// wait for the reply to a registration, so these keep them for rpcExecute
+static unique_ptr<ShardMap> pending_shards;
+static bool pending_terminate = false;
 static int client_socket = SOCK_INVALID;
-static unordered_map<string, skeleton> functions;
-static unordered_map<int, Message> requests;
-static vector<thread> calls;
-static int host_port = 0;
-static char host_name[48];
 
-int rpcInit() {
-    // Get environment variables
-    const char* binder_addr = getenv("BINDER_ADDRESS");
-    const char* binder_port = getenv("BINDER_PORT");
-    if (binder_addr == nullptr || binder_port == nullptr) {
-        return ERROR_MISSING_ENV;    
+// A request waiting to be run as part of a batch
+struct Call {
+    reactor::Reactor* owner;
+    int client;
+    shared_ptr<Message> msg;
+    Deadline deadline;
+};
+
+// A function this server runs, and how long it has been taking
+// Fast functions run on the reactor thread that read the request,
+// which saves handing it to a worker
+struct Function {
+    skeleton f;
+    atomic<bool> inline_calls;      // Whether calls run on the reactor thread
+    atomic<bool> demoted;           // Was inline but got slow, so never again
+    atomic<long> samples;           // Calls timed
+    atomic<long> average;           // Moving average run time, in nanoseconds
+
+    // Set by rpcSetLimits before rpcExecute
+    int max_concurrent;             // Calls run at once, or 0 for no limit
+    int max_queued;                 // Calls waiting for a slot, or 0 for no limit
+    workers::Priority priority;
+
+    mutex lock;                     // Guards running and waiting
+    int running;                    // Calls queued on or run by the workers
+    deque<workers::Task> waiting;   // Calls held back by max_concurrent, oldest first
+
+    // Set by rpcRegisterBatch, and then used instead of f
+    batch_skeleton batch;
+    mutex batch_lock;               // Guards pending and opened
+    condition_variable filled;      // Signalled when pending reaches the batch limit
+    vector<Call> pending;           // Calls for the next batch, oldest first
+    chrono::steady_clock::time_point opened;    // When the first pending call arrived
+
+    Function(): f(nullptr), inline_calls(false), demoted(false), samples(0), average(0),
+        max_concurrent(0), max_queued(0), priority(workers::PRIORITY_NORMAL), running(0),
+        batch(nullptr) {
     }
+};
+
+static unordered_map<string, Function> functions;
+static phash::Table<Function*> dispatch_table;     // Frozen from functions when rpcExecute starts
+static unordered_map<int, unique_ptr<Message>> requests;
+static vector<unique_ptr<reactor::Reactor>> reactors;  // Serve client connections
+static unique_ptr<workers::Pool> executors;    // Runs calls, kept after rpcExecute for its stats
+
+// A function registered by this server
+struct Registration {
+    string name;
+    vector<int> arg_types;  // Includes the null terminator
+    string key;             // The function signature
+    int flags;              // eg RPC_FUNCTION_PURE
+    bool registered;        // Whether the binder has accepted it yet
+    Location binder;        // The binder that accepted it
+
+    Registration(const char* name, int* arg_types, int flags):
+        name(name), arg_types(arg_types, arg_types + numArgs(arg_types) + 1),
+        key(getSignature(name, arg_types)), flags(flags), registered(false) {
+    }
+};
+
+static vector<Registration> registrations;
+
+// A lost binder and when to next try reconnecting to it
+struct Reconnect {
+    chrono::steady_clock::time_point when;
+    chrono::milliseconds backoff;
+};
+
+static const chrono::milliseconds MIN_BACKOFF(100);
+static const chrono::milliseconds MAX_BACKOFF(5000);
+
+// Heartbeats keep the binders' leases on this server alive
+static const chrono::milliseconds DEFAULT_HEARTBEAT_INTERVAL(1000);
+static atomic<int> in_flight(0);
+static int host_port = 0;
+static char host_name[48];
+static char host_address[48];           // Numeric form of host_name, so clients can skip resolving it
 
-    // Get information for the server address
+// Connect to a binder, returning the socket or an error code
+static int connectToBinder(const char* binder_addr, const char* binder_port) {
+    // Get information for the binder address
     addrinfo hints, *addr;
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
@@ -55,149 +141,575 @@ int rpcInit() {
         return ERROR_ADDRINFO;    
     }
 
-    // Connect to binder
-    binder_socket = socket(PF_INET, SOCK_STREAM, 0);
-    if (binder_socket == SOCK_INVALID) {
+    int socketfd = socket(PF_INET, SOCK_STREAM, 0);
+    if (socketfd == SOCK_INVALID) {
+        freeaddrinfo(addr);
         return ERROR_SOCKET_CREATE;
     }
 
-    int status = connect(binder_socket, addr->ai_addr, addr->ai_addrlen);
+    int status = connect(socketfd, addr->ai_addr, addr->ai_addrlen);
     freeaddrinfo(addr);
     if (status < 0) {
-        close(binder_socket);
-        binder_socket = SOCK_INVALID;
+        close(socketfd);
         return ERROR_SOCKET_CONNECT;
     }
 
-    // Open socket for clients to connect to
-    client_socket = socket(PF_INET, SOCK_STREAM, 0);
-    if (client_socket == SOCK_INVALID) {
-        close(binder_socket);
-        binder_socket = SOCK_INVALID;
-        return ERROR_SOCKET_CREATE;    
+    return socketfd;
+}
+
+// Ask the binder named by the environment for the shard map
+static int getShardMap(const char* binder_addr, const char* binder_port) {
+    int socketfd = connectToBinder(binder_addr, binder_port);
+    if (socketfd < 0) {
+        return socketfd;
+    }
+
+    Message msg;
+    msg.setType(MessageType::SHARD_MAP);
+
+    try {
+        msg.sendMessage(socketfd);
+        msg.recvBlock(socketfd);
+    } catch(Message::SendError) {
+        close(socketfd);
+        return ERROR_MESSAGE_SEND;
+    } catch(Message::RecvError) {
+        close(socketfd);
+        return ERROR_MESSAGE_RECV;
     }
 
+    close(socketfd);
+    shards = ShardMap(msg.getLocations());
+    return 0;
+}
+
+// Close the connections to every binder and to clients
+static void closeSockets() {
+    for (const auto& binder : binder_sockets) {
+        close(binder.second);
+    }
+    binder_sockets.clear();
+
+    if (client_socket != SOCK_INVALID) {
+        close(client_socket);
+        client_socket = SOCK_INVALID;
+    }
+}
+
+// Heartbeat a binder as soon as we connect, so it sends us shard map
+// changes even before we register anything with it
+static void announce(int binder_socket) {
+    Message msg;
+    msg.setType(MessageType::HEARTBEAT);
+    msg.setLoad(vector<int>(NUM_LOAD_STATS));
+
+    try {
+        msg.sendMessage(binder_socket);
+    } catch(Message::SendError) {
+    }
+}
+
+int rpcInit() {
+    // Get environment variables
+    const char* binder_addr = getenv("BINDER_ADDRESS");
+    const char* binder_port = getenv("BINDER_PORT");
+    if (binder_addr == nullptr || binder_port == nullptr) {
+        return ERROR_MISSING_ENV;    
+    }
+
+    // Find every binder in the cluster
+    int status = getShardMap(binder_addr, binder_port);
+    if (status < 0) {
+        return status;
+    }
+
+    // Connect to every binder, since each owns a shard of the signatures
+    for (const auto& location : shards.all()) {
+        int socketfd = connectToBinder(location.first.c_str(),
+            to_string(location.second).c_str());
+        if (socketfd < 0) {
+            closeSockets();
+            return socketfd;
+        }
+
+        binder_sockets[location] = socketfd;
+        announce(socketfd);
+    }
+
+    // Open socket for clients to connect to
+    addrinfo hints, *addr;
     memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
+    hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
 
     if (getaddrinfo(nullptr, "0", &hints, &addr) != 0) {
-        close(binder_socket);
-        close(client_socket);
-        binder_socket = SOCK_INVALID;
-        client_socket = SOCK_INVALID;
+        closeSockets();
         return ERROR_ADDRINFO;
     }
 
-    // Bind socket
-    status = bind(client_socket, addr->ai_addr, addr->ai_addrlen);
+    // rpcExecute opens a listener on the same port for each other reactor
+    client_socket = reactor::listenOn(addr->ai_addr, addr->ai_addrlen,
+        reactor::Options::fromEnv().backlog);
     freeaddrinfo(addr);
-    if (status < 0) {
-        close(binder_socket);
-        close(client_socket);
-        binder_socket = SOCK_INVALID;
+    if (client_socket < 0) {
+        status = client_socket;
         client_socket = SOCK_INVALID;
-        return ERROR_SOCKET_BIND;    
-    }
-   
-    // Listen for connections
-    if (listen(client_socket, 5) < 0) {
-        close(binder_socket);
-        close(client_socket);
-        binder_socket = SOCK_INVALID;
-        client_socket = SOCK_INVALID;
-        return ERROR_SOCKET_LISTEN;
+        closeSockets();
+        return status;
     }
  
     // Get the server name and port
     sockaddr_in server_addr;
     socklen_t len = sizeof(server_addr);
     if (getsockname(client_socket, (sockaddr*)&server_addr, &len) < 0) {
-        close(binder_socket);
-        close(client_socket);
-        binder_socket = SOCK_INVALID;
-        client_socket = SOCK_INVALID;
+        closeSockets();
         return ERROR_SOCKET_NAME;
     }
 
     if (gethostname(host_name, sizeof(host_name)) < 0) {
-        close(binder_socket);
-        close(client_socket);
-        binder_socket = SOCK_INVALID;
-        client_socket = SOCK_INVALID;
+        closeSockets();
         return ERROR_HOSTNAME;
     }
 
     auto host = gethostbyname(host_name);
     if (host == nullptr) {
-        close(binder_socket);
-        close(client_socket);
-        binder_socket = SOCK_INVALID;
-        client_socket = SOCK_INVALID;
+        closeSockets();
         return ERROR_HOSTNAME;
     }
 
     host_port = ntohs(server_addr.sin_port);
     memcpy(host_name, host->h_name, strlen(host->h_name) + 1);
+    if (host->h_addr_list[0] == nullptr ||
+        inet_ntop(host->h_addrtype, host->h_addr_list[0], host_address, sizeof(host_address)) == nullptr ||
+        isLoopback(host_address)) {
+        // Many hosts map their own name to a loopback address, which
+        // would send clients on other hosts to themselves
+        host_address[0] = '\0';
+    }
 
     return 0;
 }
 
-int rpcRegister(char* name, int* argTypes, skeleton f) {
-    // If we are not connected to the binder
-    if (binder_socket == SOCK_INVALID) {
-        return ERROR_NOT_CONNECTED_BINDER;
+// Send a REGISTER_BATCH request to a binder
+// Returns the first error, otherwise the first warning, otherwise 0
+static int registerBatch(int binder_socket, const vector<Registration*>& batch) {
+    vector<pair<string, vector<int>>> entries;
+    vector<int> flags;
+    for (const auto registration : batch) {
+        entries.push_back(make_pair(registration->name, registration->arg_types));
+        flags.push_back(registration->flags);
     }
 
     // Construct message
     Message msg;
-    msg.setType(MessageType::REGISTER);
-    msg.setName(name);
+    msg.setType(MessageType::REGISTER_BATCH);
     msg.setServerIdentifier(host_name);
     msg.setPort(host_port);
-    msg.setArgTypes(argTypes);
+    msg.setAddress(host_address);
+    msg.setRegistrations(entries, flags);
 
     // Send message to binder
+    unique_ptr<Message> reply;
     try {
         msg.sendMessage(binder_socket);
-        msg.recvBlock(binder_socket);
+        for (;;) {
+            reply.reset(new Message());
+            reply->recvBlock(binder_socket);
+            if (reply->getType() == MessageType::SHARD_MAP_SUCCESS) {
+                pending_shards.reset(new ShardMap(reply->getLocations()));
+            } else if (reply->getType() == MessageType::TERMINATE) {
+                pending_terminate = true;
+            } else {
+                break;
+            }
+        }
     } catch(Message::SendError) {
         return ERROR_MESSAGE_SEND;
     } catch(Message::RecvError) {
         return ERROR_MESSAGE_RECV;
     }
 
-    // Add function to local datatabse
+    int ret = 0;
+    for (const int reason_code : reply->getReasonCodes()) {
+        if (reason_code < 0) {
+            return reason_code;
+        } else if (ret == 0) {
+            ret = reason_code;
+        }
+    }
+
+    return ret;
+}
+
+// Registrations are queued locally and sent to the binders in
+// batches by rpcRegisterFlush, which rpcExecute also calls
+int rpcRegister(char* name, int* argTypes, skeleton f) {
+    return rpcRegisterWithFlags(name, argTypes, f, 0);
+}
+
+// Register a function along with flags the binder passes on to clients
+// Re-registering with different flags sends the function again
+int rpcRegisterWithFlags(char* name, int* argTypes, skeleton f, int flags) {
+    // If we are not connected to the binder
+    if (binder_sockets.empty()) {
+        return ERROR_NOT_CONNECTED_BINDER;
+    }
+
     string key = getSignature(name, argTypes); 
-    functions[key] = f;
+    int status = 0;
+    if (functions.find(key) == functions.end()) {
+        registrations.push_back(Registration(name, argTypes, flags));
+    } else {
+        status = WARNING_DUPLICATE_FUNCTION;
+        for (auto& registration : registrations) {
+            if (registration.key == key && registration.flags != flags) {
+                registration.flags = flags;
+                registration.registered = false;
+            }
+        }
+    }
+
+    // Add function to local datatabse
+    // Functions hinted fast run inline until they prove otherwise
+    Function& function = functions[key];
+    function.f = f;
+    function.batch = nullptr;
+    function.inline_calls = (flags & RPC_FUNCTION_FAST) && !function.demoted;
+
+    return status;
+}
+
+// Register a function whose calls the server runs in batches
+// Queued calls with the same arg types are passed to f together, with
+// each arg laid out as an array holding that arg of every call in turn
+int rpcRegisterBatch(char* name, int* argTypes, batch_skeleton f) {
+    const int status = rpcRegisterWithFlags(name, argTypes, nullptr, 0);
+    if (status < 0) {
+        return status;
+    }
+
+    functions[getSignature(name, argTypes)].batch = f;
+    return status;
+}
+
+// Limit how many calls to a registered function run at once and how
+// many more may wait, and set the priority its calls are queued with
+// Calls beyond both limits are refused with ERROR_FUNCTION_BUSY
+int rpcSetLimits(char* name, int* argTypes, int maxConcurrent, int maxQueued, int priority) {
+    auto it = functions.find(getSignature(name, argTypes));
+    if (it == functions.end()) {
+        return ERROR_MISSING_FUNCTION;
+    }
 
-    return msg.getReasonCode();
+    Function& function = it->second;
+    function.max_concurrent = max(maxConcurrent, 0);
+    function.max_queued = max(maxQueued, 0);
+    function.priority = (workers::Priority)min(max(priority, (int)RPC_PRIORITY_HIGH),
+        (int)RPC_PRIORITY_LOW);
+    return 0;
 }
 
-static void executeAsync(int client) {
-    // Get the request and function signature
-    auto& msg = requests[client];
-    string key = getSignature(msg.getName(), msg.getArgTypes());
+int rpcRegisterFlush() {
+    // If we are not connected to the binder
+    if (binder_sockets.empty()) {
+        return ERROR_NOT_CONNECTED_BINDER;
+    }
 
-    // Execute the function if it exists
+    // Send one batch to each binder that owns queued functions
+    map<Location, vector<Registration*>> batches;
+    for (auto& registration : registrations) {
+        if (!registration.registered) {
+            batches[shards.owner(registration.key)].push_back(&registration);
+        }
+    }
+
+    int ret = 0;
+    for (const auto& batch : batches) {
+        auto it = binder_sockets.find(batch.first);
+        int status = it == binder_sockets.end() ? ERROR_NOT_CONNECTED_BINDER
+            : registerBatch(it->second, batch.second);
+
+        if (status >= 0) {
+            for (const auto registration : batch.second) {
+                registration->registered = true;
+                registration->binder = batch.first;
+            }
+        }
+
+        // Keep the first error, or failing that the first warning
+        if (ret == 0 || (status < 0 && ret > 0)) {
+            ret = status;
+        }
+    }
+
+    return ret;
+}
+
+// Reconnect to a binder that went away and register
+// every function it owns with it again
+static int reconnectBinder(const Location& location) {
+    int socketfd = connectToBinder(location.first.c_str(),
+        to_string(location.second).c_str());
+    if (socketfd < 0) {
+        return socketfd;
+    }
+    announce(socketfd);
+
+    vector<Registration*> batch;
+    for (auto& registration : registrations) {
+        if (shards.owner(registration.key) == location) {
+            batch.push_back(&registration);
+        }
+    }
+
+    if (!batch.empty()) {
+        int status = registerBatch(socketfd, batch);
+        if (status < 0) {
+            close(socketfd);
+            return status;
+        }
+
+        for (const auto registration : batch) {
+            registration->registered = true;
+            registration->binder = location;
+        }
+    }
+
+    binder_sockets[location] = socketfd;
+    return socketfd;
+}
+
+// Run time of a call that decides whether its function runs inline,
+// set from RPC_INLINE_US when rpcExecute starts
+static chrono::nanoseconds inline_limit(chrono::microseconds(20));
+
+// How long the first call of a batch waits for others, and how many
+// calls a batch may hold, set from RPC_BATCH_US and RPC_BATCH_MAX
+static chrono::microseconds batch_window(200);
+static int batch_limit = 64;
+
+// Calls timed before a function's average is trusted
+static const long INLINE_SAMPLES = 16;
+
+// Time a call, moving its function on or off the reactor threads
+// Functions are promoted once their average run time is within the
+// limit, and demoted for good if it later grows beyond it
+static void record(Function& function, chrono::nanoseconds elapsed) {
+    const long samples = ++function.samples;
+    long average = function.average;
+    average = samples == 1 ? elapsed.count() : average + (elapsed.count() - average) / 8;
+    function.average = average;
+
+    if (samples < INLINE_SAMPLES) {
+        return;
+    }
+
+    if (function.inline_calls && average > inline_limit.count()) {
+        function.inline_calls = false;
+        function.demoted = true;
+    } else if (!function.inline_calls && !function.demoted && average <= inline_limit.count()) {
+        function.inline_calls = true;
+    }
+}
+
+static void execute(reactor::Reactor& owner, int client, shared_ptr<Message> msg,
+    Function* function, Deadline deadline) {
+
+    ++in_flight;
+
+    // Execute the function if it exists and the caller is still waiting
     try {
-        if (functions[key] == nullptr) {
-            msg.setType(MessageType::EXECUTE_FAILURE);
-            msg.setReasonCode(ERROR_MISSING_FUNCTION);
-            msg.sendMessage(client);
+        if (chrono::steady_clock::now() >= deadline) {
+            msg->setType(MessageType::EXECUTE_FAILURE);
+            msg->setReasonCode(ERROR_DEADLINE_EXCEEDED);
+        } else if (function == nullptr) {
+            msg->setType(MessageType::EXECUTE_FAILURE);
+            msg->setReasonCode(ERROR_MISSING_FUNCTION);
+        } else {
+            const auto started = chrono::steady_clock::now();
+            const int status = function->f(msg->getArgTypes(), msg->getArgs());
+            record(*function, chrono::steady_clock::now() - started);
+
+            if (status < 0) {
+                msg->setType(MessageType::EXECUTE_FAILURE);
+                msg->setReasonCode(ERROR_FUNCTION_CALL);
+            } else {
+                msg->setType(MessageType::EXECUTE_SUCCESS);
+            }
+        }
+
+        msg->sendMessage(client);
+        owner.rearm(client);
+    } catch(Message::SendError) {
+        owner.discard(client);
+    }
+
+    --in_flight;
+}
+
+// Send a call's reply and watch its connection for the next request
+static void reply(const Call& call) {
+    try {
+        call.msg->sendMessage(call.client);
+        call.owner->rearm(call.client);
+    } catch(Message::SendError) {
+        call.owner->discard(call.client);
+    }
+}
+
+static bool sameArgTypes(int* a, int* b) {
+    const int num_args = numArgs(a);
+    return num_args == numArgs(b) && memcmp(a, b, sizeof(*a) * num_args) == 0;
+}
+
+// Run calls with identical arg types as one call of the batch skeleton
+static void runBatch(Function* function, const vector<Call>& calls) {
+    int* arg_types = calls[0].msg->getArgTypes();
+    const int num_args = numArgs(arg_types);
+
+    // Gather each arg into an array with an element per call
+    vector<vector<char>> columns(num_args);
+    vector<void*> args(num_args);
+    for (int i = 0; i < num_args; ++i) {
+        const int size = argSize(arg_types[i]);
+        columns[i].resize(size * calls.size());
+        for (size_t j = 0; j < calls.size(); ++j) {
+            memcpy(&columns[i][size * j], calls[j].msg->getArgs()[i], size);
         }
+        args[i] = columns[i].data();
+    }
 
-        int status = (functions[key])(msg.getArgTypes(), msg.getArgs());
+    const int status = function->batch(calls.size(), arg_types, args.data());
+
+    // Scatter the outputs back to each call's reply
+    for (size_t j = 0; j < calls.size(); ++j) {
+        Message& msg = *calls[j].msg;
         if (status < 0) {
             msg.setType(MessageType::EXECUTE_FAILURE);
             msg.setReasonCode(ERROR_FUNCTION_CALL);
-            msg.sendMessage(client);
+        } else {
+            for (int i = 0; i < num_args; ++i) {
+                if (isOutput(arg_types[i])) {
+                    const int size = argSize(arg_types[i]);
+                    memcpy(msg.getArgs()[i], &columns[i][size * j], size);
+                }
+            }
+            msg.setType(MessageType::EXECUTE_SUCCESS);
         }
+        reply(calls[j]);
+    }
+}
 
-        msg.setType(MessageType::EXECUTE_SUCCESS);
-        msg.sendMessage(client);
-    } catch(Message::SendError) {
+// Run the calls waiting for a batch function, once there are enough of
+// them or the first has waited out the batch window
+static void flush(Function* function) {
+    vector<Call> calls;
+    {
+        unique_lock<mutex> guard(function->batch_lock);
+        function->filled.wait_until(guard, function->opened + batch_window,
+            [function] { return (int)function->pending.size() >= batch_limit; });
+        calls.swap(function->pending);
+    }
+
+    const int count = calls.size();
+    in_flight += count;
+    const auto now = chrono::steady_clock::now();
+    while (!calls.empty()) {
+        // Calls whose callers gave up are dropped, and the rest are split
+        // into batches of the same arg types
+        vector<Call> batch, rest;
+        for (auto& call : calls) {
+            if (now >= call.deadline) {
+                call.msg->setType(MessageType::EXECUTE_FAILURE);
+                call.msg->setReasonCode(ERROR_DEADLINE_EXCEEDED);
+                reply(call);
+            } else if ((int)batch.size() < batch_limit && (batch.empty() ||
+                sameArgTypes(batch[0].msg->getArgTypes(), call.msg->getArgTypes()))) {
+                batch.push_back(call);
+            } else {
+                rest.push_back(call);
+            }
+        }
+
+        if (!batch.empty()) {
+            runBatch(function, batch);
+        }
+        calls.swap(rest);
+    }
+    in_flight -= count;
+}
+
+// Fill in the queue depth and steal count of up to count workers
+// Returns the number of workers, 0 before rpcExecute starts them
+int rpcWorkerStats(int* queued, long* steals, int count) {
+    if (executors == nullptr) {
+        return 0;
+    }
+
+    const auto stats = executors->stats();
+    for (int i = 0; i < count && i < (int)stats.size(); ++i) {
+        queued[i] = stats[i].queued;
+        steals[i] = stats[i].steals;
+    }
+    return stats.size();
+}
+
+// Get the batch window and size limit, which may be set by the environment
+static chrono::microseconds batchWindow() {
+    const char* window = getenv("RPC_BATCH_US");
+    if (window == nullptr || atoi(window) < 0) {
+        return chrono::microseconds(200);
+    }
+
+    return chrono::microseconds(atoi(window));
+}
+
+static int batchLimit() {
+    const char* limit = getenv("RPC_BATCH_MAX");
+    if (limit == nullptr || atoi(limit) <= 0) {
+        return 64;
+    }
+
+    return atoi(limit);
+}
+
+// Get the inline run time limit, which may be set by the environment
+static chrono::nanoseconds inlineLimit() {
+    const char* limit = getenv("RPC_INLINE_US");
+    if (limit == nullptr || atoi(limit) < 0) {
+        return chrono::microseconds(20);
+    }
+
+    return chrono::microseconds(atoi(limit));
+}
+
+// Get the heartbeat interval, which may be set by the environment
+static chrono::milliseconds heartbeatInterval() {
+    const char* interval = getenv("RPC_HEARTBEAT_MS");
+    if (interval == nullptr || atoi(interval) <= 0) {
+        return DEFAULT_HEARTBEAT_INTERVAL;
+    }
+
+    return chrono::milliseconds(atoi(interval));
+}
+
+// Tell every binder we are alive, along with our current load
+static void sendHeartbeats(int connections) {
+    vector<int> load(NUM_LOAD_STATS);
+    load[LOAD_IN_FLIGHT] = in_flight;
+    load[LOAD_CONNECTIONS] = connections;
+
+    Message msg;
+    msg.setType(MessageType::HEARTBEAT);
+    msg.setLoad(load);
+
+    // A failed send shows up as a lost binder when we next read from it
+    for (const auto& binder : binder_sockets) {
+        try {
+            msg.sendMessage(binder.second);
+        } catch(Message::SendError) {
+        }
     }
 }
 
@@ -207,81 +719,413 @@ void cleanup(int socketfd, fd_set& master_set) {
     FD_CLR(socketfd, &master_set);
 }
 
+// Find which binder the socket is connected to
+static Location binderLocation(int socketfd) {
+    for (const auto& binder : binder_sockets) {
+        if (binder.second == socketfd) {
+            return binder.first;
+        }
+    }
+
+    return Location();
+}
+
+static workers::Task limited(Function* function, workers::Task task);
+
+// Hand a finished call's slot to the oldest call waiting for it, if any
+static void release(Function* function) {
+    for (;;) {
+        workers::Task next;
+        {
+            lock_guard<mutex> guard(function->lock);
+            if (function->waiting.empty()) {
+                --function->running;
+                return;
+            }
+            next = move(function->waiting.front());
+            function->waiting.pop_front();
+        }
+
+        // Run it here rather than drop it if the workers are full
+        if (executors->submit(limited(function, next), function->priority)) {
+            return;
+        }
+        next();
+    }
+}
+
+// Wrap a call so that it gives up its slot once done
+static workers::Task limited(Function* function, workers::Task task) {
+    return [function, task] {
+        task();
+        release(function);
+    };
+}
+
+// Queue a call for the workers, or hold it back while its function is
+// at its concurrency limit
+// Returns 0 or the code to refuse the call with
+static int schedule(Function* function, workers::Task task) {
+    if (function == nullptr || function->max_concurrent == 0) {
+        const auto priority = function == nullptr ? workers::PRIORITY_NORMAL : function->priority;
+        return executors->submit(move(task), priority) ? 0 : ERROR_SERVER_BUSY;
+    }
+
+    lock_guard<mutex> guard(function->lock);
+    if (function->running < function->max_concurrent) {
+        if (!executors->submit(limited(function, move(task)), function->priority)) {
+            return ERROR_SERVER_BUSY;
+        }
+        ++function->running;
+        return 0;
+    }
+
+    if (function->max_queued > 0 && (int)function->waiting.size() >= function->max_queued) {
+        return ERROR_FUNCTION_BUSY;
+    }
+    function->waiting.push_back(move(task));
+    return 0;
+}
+
+// Add a call to its function's next batch
+// The first call of a batch sends a worker to run it, so returns 0 or
+// the code to refuse the call with if that fails
+static int join(Function* function, const Call& call) {
+    lock_guard<mutex> guard(function->batch_lock);
+    function->pending.push_back(call);
+    if (function->pending.size() > 1) {
+        if ((int)function->pending.size() >= batch_limit) {
+            function->filled.notify_one();
+        }
+        return 0;
+    }
+
+    function->opened = chrono::steady_clock::now();
+    const int status = schedule(function, [function] { flush(function); });
+    if (status != 0) {
+        function->pending.clear();
+    }
+    return status;
+}
+
+// Run a request from a client on a worker
+static void dispatch(reactor::Reactor& owner, int client, unique_ptr<Message> msg) {
+    // Only binders may terminate the server, and they do so over
+    // their own connections
+    if (msg->getType() != MessageType::EXECUTE) {
+        owner.discard(client);
+        return;
+    }
+
+    // The worker owns the request and the connection until it
+    // hands the connection back
+    // The caller gives up after its timeout, so the request
+    // is dropped if it has not run by then
+    Deadline deadline = Deadline::max();
+    if (msg->getTimeout() > 0) {
+        deadline = chrono::steady_clock::now() + chrono::milliseconds(msg->getTimeout());
+    }
+
+    // The dispatch table is fixed once rpcExecute starts, so reactors
+    // look up functions without locking
+    Function* const* found = dispatch_table.find(getSignature(msg->getName(), msg->getArgTypes()));
+    Function* function = found == nullptr ? nullptr : *found;
+
+    // Limited functions always go through the workers, which count them
+    shared_ptr<Message> request(move(msg));
+    if (function != nullptr && function->batch == nullptr &&
+        function->inline_calls && function->max_concurrent == 0) {
+        execute(owner, client, request, function, deadline);
+        return;
+    }
+
+    reactor::Reactor* reactor = &owner;
+    int status = 0;
+    if (function != nullptr && function->batch != nullptr) {
+        status = join(function, Call{reactor, client, request, deadline});
+    } else {
+        status = schedule(function, [reactor, client, request, function, deadline] {
+            execute(*reactor, client, request, function, deadline);
+        });
+    }
+    if (status == 0) {
+        return;
+    }
+
+    // The workers or the function's queue are full, so
+    // the caller should try another server
+    try {
+        request->setType(MessageType::EXECUTE_FAILURE);
+        request->setReasonCode(status);
+        request->sendMessage(client);
+        owner.rearm(client);
+    } catch(Message::SendError) {
+        owner.discard(client);
+    }
+}
+
+// Start a reactor for each listener on the server's port
+static int startReactors() {
+    const auto options = reactor::Options::fromEnv();
+    sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (getsockname(client_socket, (sockaddr*)&address, &length) < 0) {
+        return ERROR_SOCKET_NAME;
+    }
+
+    // The first reactor takes over the original listener
+    reactors.emplace_back(new reactor::Reactor(client_socket, options.idle_timeout, dispatch));
+    client_socket = SOCK_INVALID;
+
+    for (int i = 1; i < options.reactors; ++i) {
+        // Without SO_REUSEPORT the server makes do with fewer reactors
+        int listener = reactor::listenOn((sockaddr*)&address, length, options.backlog);
+        if (listener < 0) {
+            break;
+        }
+        reactors.emplace_back(new reactor::Reactor(listener, options.idle_timeout, dispatch));
+    }
+
+    for (auto& reactor : reactors) {
+        int status = reactor->start();
+        if (status < 0) {
+            return status;
+        }
+    }
+    return 0;
+}
+
+// Stop taking requests, finish the ones already taken and close
+// every client connection
+static void stopReactors() {
+    for (auto& reactor : reactors) {
+        reactor->stop();
+    }
+
+    // Run the queued calls and wait for the workers to finish
+    executors->stop();
+
+    for (auto& reactor : reactors) {
+        reactor->close();
+    }
+    reactors.clear();
+}
+
+// Whether a binder is still part of the cluster
+static bool inCluster(const Location& location) {
+    const auto& all = shards.all();
+    return find(all.begin(), all.end(), location) != all.end();
+}
+
+// Follow a binder joining or leaving the cluster: drop the binders that
+// left, connect to the ones that joined, and register every function
+// whose signature moved with its new owner
+static void updateShards(const ShardMap& latest, fd_set& master_set, int& max_socket,
+        map<Location, Reconnect>& reconnects) {
+    shards = latest;
+    for (auto it = binder_sockets.begin(); it != binder_sockets.end();) {
+        if (inCluster(it->first)) {
+            ++it;
+        } else {
+            cleanup(it->second, master_set);
+            it = binder_sockets.erase(it);
+        }
+    }
+
+    for (auto it = reconnects.begin(); it != reconnects.end();) {
+        it = inCluster(it->first) ? next(it) : reconnects.erase(it);
+    }
+
+    for (auto& registration : registrations) {
+        if (shards.owner(registration.key) != registration.binder) {
+            registration.registered = false;
+        }
+    }
+
+    // Connecting registers everything the new binder owns
+    for (const auto& location : shards.all()) {
+        if (binder_sockets.count(location) > 0 || reconnects.count(location) > 0) {
+            continue;
+        }
+
+        int socketfd = reconnectBinder(location);
+        if (socketfd < 0) {
+            reconnects[location] = {
+                chrono::steady_clock::now() + MIN_BACKOFF, MIN_BACKOFF
+            };
+            continue;
+        }
+
+        FD_SET(socketfd, &master_set);
+        max_socket = max(max_socket, socketfd);
+    }
+
+    // Binders still being reconnected get theirs when they come back
+    rpcRegisterFlush();
+}
+
+// Count the open client connections
+static int countConnections() {
+    int connections = 0;
+    for (auto& reactor : reactors) {
+        connections += reactor->connections();
+    }
+    return connections;
+}
+
 int rpcExecute() {
     // If the server is not running
     if (client_socket == SOCK_INVALID) {
         return ERROR_SERVER_NOT_RUNNING;
     }
 
+    // Send any registrations still queued
+    // A binder that cannot take its share now is sent it when we get it
+    // back, so only give up if no binder accepted anything
+    int status = rpcRegisterFlush();
+    if (status < 0 && none_of(registrations.begin(), registrations.end(),
+            [](const Registration& registration) { return registration.registered; })) {
+        return status;
+    }
+
+    // Freeze the functions registered so far for the reactors to look up
+    vector<pair<string, Function*>> entries;
+    for (auto& function : functions) {
+        entries.push_back(make_pair(function.first, &function.second));
+    }
+    dispatch_table = phash::Table<Function*>(entries);
+
+    // Calls run on a fixed set of workers, and requests are read by the
+    // reactors, so this thread only looks after the binders
+    executors.reset(new workers::Pool(workers::Options::fromEnv()));
+    inline_limit = inlineLimit();
+    batch_window = batchWindow();
+    batch_limit = batchLimit();
+    status = startReactors();
+    if (status < 0) {
+        stopReactors();
+        return status;
+    }
+
     fd_set master_set, read_set;
     FD_ZERO(&master_set);
-    FD_SET(binder_socket, &master_set);
-    FD_SET(client_socket, &master_set);
-    int max_socket = max(client_socket, binder_socket);
+    int max_socket = 0;
+
+    for (const auto& binder : binder_sockets) {
+        FD_SET(binder.second, &master_set);
+        max_socket = max(max_socket, binder.second);
+    }
+
+    // Binders we lost and are trying to get back
+    map<Location, Reconnect> reconnects;
+    const auto heartbeat_interval = heartbeatInterval();
+    auto next_heartbeat = chrono::steady_clock::now() + heartbeat_interval;
     int ret = 0;
 
     for (;;) {
         bool terminate = false;
         read_set = master_set;
-        if (select(max_socket + 1, &read_set, nullptr, nullptr, nullptr) < 0) {
+
+        // Wake up in time for the next heartbeat or reconnect attempt
+        auto next = next_heartbeat;
+        for (const auto& reconnect : reconnects) {
+            next = min(next, reconnect.second.when);
+        }
+
+        auto remaining = chrono::duration_cast<chrono::microseconds>(
+            next - chrono::steady_clock::now()).count();
+        remaining = max(remaining, 0L);
+
+        timeval timeout;
+        timeout.tv_sec = remaining / 1000000;
+        timeout.tv_usec = remaining % 1000000;
+
+        if (select(max_socket + 1, &read_set, nullptr, nullptr, &timeout) < 0) {
             ret = ERROR_SOCKET_SELECT;
             break;
         }
 
-        // Service incoming requests
+        const auto now = chrono::steady_clock::now();
+        if (now >= next_heartbeat) {
+            sendHeartbeats(countConnections());
+            next_heartbeat = now + heartbeat_interval;
+        }
+
+        // Try to get back any binders that are due
+        for (auto it = reconnects.begin(); it != reconnects.end();) {
+            auto& reconnect = it->second;
+            if (reconnect.when > now) {
+                ++it;
+                continue;
+            }
+
+            int socketfd = reconnectBinder(it->first);
+            if (socketfd < 0) {
+                reconnect.backoff = min(reconnect.backoff * 2, MAX_BACKOFF);
+                reconnect.when = now + reconnect.backoff;
+                ++it;
+                continue;
+            }
+
+            FD_SET(socketfd, &master_set);
+            max_socket = max(max_socket, socketfd);
+            it = reconnects.erase(it);
+        }
+
+        // Service messages from the binders
         for (int i = 0; i <= max_socket; ++i) {
             if (!FD_ISSET(i, &read_set)) {
                 continue;
             }    
-            
-            if (i == client_socket) {
-                // Accept the incoming connection
-                int client = accept(client_socket, nullptr, nullptr);
-                if (client != SOCK_INVALID) {
-                    FD_SET(client, &master_set);
-                    max_socket = max(max_socket, client); 
+
+            auto& msg = requests[i];
+            if (msg == nullptr) {
+                msg.reset(new Message());
+            }
+
+            try {
+                msg->recvNonBlock(i);
+                if (!msg->eom()) {
+                    continue;
                 }
-            } else {
-                // Get the request message         
-                auto& msg = requests[i];
-                try {
-                    msg.recvNonBlock(i);
-                    if (!msg.eom()) {
-                        continue;
-                    }
-            
-                    // If terminate request
-                    if (msg.getType() == MessageType::TERMINATE) {
-                        // Autheticate termination request
-                        if (i != binder_socket) {
-                            cleanup(i, master_set);
-                            continue;
-                        }
-
-                        terminate = true;
-                        break;
-                    } 
-
-                    // Otherwise, it's an execute request
-                    FD_CLR(i, &master_set);
-                    thread th(executeAsync, i);
-                    calls.push_back(move(th));
-                } catch(...) {
-                    // Usually end up here if a connection closed
-                    cleanup(i, master_set);
+
+                // Binders send termination requests, and new shard
+                // maps when a binder joins or leaves
+                if (msg->getType() == MessageType::TERMINATE) {
+                    terminate = true;
+                    break;
+                } else if (msg->getType() == MessageType::SHARD_MAP_SUCCESS) {
+                    pending_shards.reset(new ShardMap(msg->getLocations()));
                 }
+                requests.erase(i);
+            } catch(...) {
+                // A lost binder is not fatal, since it may be restarting
+                // Keep serving clients and try to register with it again
+                // unless it has left the cluster
+                const Location location = binderLocation(i);
+                binder_sockets.erase(location);
+                if (inCluster(location)) {
+                    reconnects[location] = {
+                        chrono::steady_clock::now() + MIN_BACKOFF, MIN_BACKOFF
+                    };
+                }
+                cleanup(i, master_set);
             }
         }
 
-        if (terminate) {
+        // Registering may itself receive another map, so keep going
+        // until the latest one has been followed
+        while (pending_shards != nullptr && !terminate && !pending_terminate) {
+            unique_ptr<ShardMap> latest(move(pending_shards));
+            updateShards(*latest, master_set, max_socket, reconnects);
+        }
+
+        if (terminate || pending_terminate) {
             break;    
         }
     }
-  
-    // Wait for all threads to finish
-    for (auto& th : calls) {
-        th.join();    
-    }
+
+    stopReactors();
  
     // Close all connections
     for (int i = 0; i <= max_socket; ++i) {
@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <string>
+
+#include "shard.h"
+using namespace std;
+
+namespace shard {
+
+// 64-bit FNV-1a, stable across processes and platforms
+unsigned long long hash(const string& key) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (const unsigned char c : key) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+ShardMap::ShardMap() {
+}
+
+ShardMap::ShardMap(const vector<Location>& shards): shards(shards) {
+    rebuild();
+}
+
+// Add a binder to the ring
+void ShardMap::add(const Location& location) {
+    if (find(shards.begin(), shards.end(), location) == shards.end()) {
+        shards.push_back(location);
+        rebuild();
+    }
+}
+
+// Remove a binder from the ring
+void ShardMap::remove(const Location& location) {
+    auto it = find(shards.begin(), shards.end(), location);
+    if (it != shards.end()) {
+        shards.erase(it);
+        rebuild();
+    }
+}
+
+// The owner is the first ring point clockwise from the signature's hash
+// Must not be called on an empty map
+const Location& ShardMap::owner(const string& signature) const {
+    const auto point = make_pair(hash(signature), 0);
+    auto it = lower_bound(ring.begin(), ring.end(), point);
+    if (it == ring.end()) {
+        it = ring.begin();
+    }
+
+    return shards[it->second];
+}
+
+const vector<Location>& ShardMap::all() const {
+    return shards;
+}
+
+bool ShardMap::empty() const {
+    return shards.empty();
+}
+
+int ShardMap::size() const {
+    return shards.size();
+}
+
+// Place every binder on the ring at several virtual points
+// so that signatures spread evenly between them
+void ShardMap::rebuild() {
+    ring.clear();
+    for (int i = 0; i < (int)shards.size(); ++i) {
+        const string id = shards[i].first + ":" + to_string(shards[i].second);
+        for (int j = 0; j < VIRTUAL_NODES; ++j) {
+            ring.push_back(make_pair(hash(id + "#" + to_string(j)), i));
+        }
+    }
+
+    sort(ring.begin(), ring.end());
+}
+
+}
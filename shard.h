@@ -0,0 +1,44 @@
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace shard {
+
+typedef std::pair<std::string, int> Location;
+
+// Hash used to place signatures and binders on the ring
+unsigned long long hash(const std::string& key);
+
+// Consistent hash ring mapping function signatures to binders
+class ShardMap {
+    std::vector<Location> shards;                               // Every binder in the cluster
+    std::vector<std::pair<unsigned long long, int>> ring;       // Sorted (point, shard index) pairs
+
+    enum {
+        VIRTUAL_NODES = 64,                                     // Ring points per binder
+    };
+
+public:
+    ShardMap();
+    explicit ShardMap(const std::vector<Location>& shards);
+
+    void add(const Location& location);
+    void remove(const Location& location);
+
+    // Get the binder that owns the given signature
+    const Location& owner(const std::string& signature) const;
+
+    const std::vector<Location>& all() const;
+    bool empty() const;
+    int size() const;
+
+private:
+    void rebuild();
+};
+
+}
+
+#endif // __SHARD_H__
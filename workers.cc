@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <cstdlib>
+
+#include "workers.h"
+using namespace std;
+
+namespace workers {
+
+Options::Options(): threads(max(1u, thread::hardware_concurrency())), queue_depth(1024) {
+}
+
+// Get the default options, overridden by the environment
+Options Options::fromEnv() {
+    Options options;
+    const char* str = getenv("RPC_SERVER_THREADS");
+    if (str != nullptr && atoi(str) > 0) {
+        options.threads = atoi(str);
+    }
+    str = getenv("RPC_SERVER_QUEUE");
+    if (str != nullptr && atoi(str) > 0) {
+        options.queue_depth = atoi(str);
+    }
+    return options;
+}
+
+Pool::Pool(const Options& options): options(options), queued(0), next(0), sleeping(0), stopping(false) {
+    for (int i = 0; i < options.threads; ++i) {
+        workers.emplace_back(new Worker());
+    }
+    for (int i = 0; i < options.threads; ++i) {
+        threads.emplace_back(&Pool::run, this, i);
+    }
+}
+
+Pool::~Pool() {
+    stop();
+}
+
+bool Pool::submit(Task task, Priority priority) {
+    // Count the task before it is visible, so no worker sleeps through it
+    if (++queued > options.queue_depth) {
+        --queued;
+        return false;
+    }
+
+    Worker& worker = *workers[next++ % workers.size()];
+    {
+        lock_guard<mutex> guard(worker.lock);
+        worker.tasks[priority].push_back(move(task));
+    }
+
+    // A worker counts itself sleeping before it last checks queued, so
+    // either it sees this task or this sees it. It holds the lock until
+    // it is waiting, so the notify cannot slip in before the wait
+    if (sleeping > 0) {
+        { lock_guard<mutex> guard(lock); }
+        ready.notify_one();
+    }
+    return true;
+}
+
+void Pool::stop() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+
+    ready.notify_all();
+    for (auto& th : threads) {
+        th.join();
+    }
+    threads.clear();
+}
+
+vector<Stats> Pool::stats() {
+    vector<Stats> stats;
+    for (auto& worker : workers) {
+        lock_guard<mutex> guard(worker->lock);
+        int queued = 0;
+        for (const auto& tasks : worker->tasks) {
+            queued += tasks.size();
+        }
+        stats.push_back(Stats{queued, worker->executed, worker->steals});
+    }
+    return stats;
+}
+
+void Pool::run(size_t index) {
+    Worker& worker = *workers[index];
+    for (;;) {
+        Task task;
+        if (take(index, task)) {
+            task();
+            ++worker.executed;
+            continue;
+        }
+
+        unique_lock<mutex> guard(lock);
+        ++sleeping;
+        ready.wait(guard, [this] { return stopping || queued > 0; });
+        --sleeping;
+        if (stopping && queued == 0) {
+            return;
+        }
+    }
+}
+
+// Take the oldest task of this worker, or else the newest of another,
+// from the most urgent priority that has one
+bool Pool::take(size_t index, Task& task) {
+    for (int priority = 0; priority < NUM_PRIORITIES; ++priority) {
+        {
+            Worker& worker = *workers[index];
+            lock_guard<mutex> guard(worker.lock);
+            auto& tasks = worker.tasks[priority];
+            if (!tasks.empty()) {
+                task = move(tasks.front());
+                tasks.pop_front();
+                --queued;
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < workers.size(); ++i) {
+            Worker& victim = *workers[(index + i) % workers.size()];
+            lock_guard<mutex> guard(victim.lock);
+            auto& tasks = victim.tasks[priority];
+            if (!tasks.empty()) {
+                task = move(tasks.back());
+                tasks.pop_back();
+                --queued;
+                ++workers[index]->steals;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+}
@@ -0,0 +1,91 @@
+#ifndef __WORKERS_H__
+#define __WORKERS_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace workers {
+
+typedef std::function<void()> Task;
+
+// Priority classes, most urgent first
+enum Priority {
+    PRIORITY_HIGH,
+    PRIORITY_NORMAL,
+    PRIORITY_LOW,
+    NUM_PRIORITIES
+};
+
+struct Options {
+    int threads;                    // Worker threads, the core count by default
+    int queue_depth;                // Tasks waiting for a worker before more are rejected
+
+    Options();
+    static Options fromEnv();
+};
+
+// What one worker has been doing
+struct Stats {
+    int queued;                     // Tasks waiting in its deque
+    long executed;                  // Tasks it ran
+    long steals;                    // Tasks it took from other workers
+};
+
+// A fixed set of threads running tasks from bounded per-worker deques
+// Tasks are dealt out to the workers in turn. A worker runs the oldest
+// task in its own deque, and once that is empty steals the newest task
+// of another worker, so a long task only holds up the tasks behind it
+// until some worker is idle. Each worker keeps a deque per priority, and
+// takes or steals from the most urgent one that has a task. Tasks are
+// rejected rather than queued once queue_depth are waiting, so a burst
+// of requests cannot use up memory
+class Pool {
+    struct Worker {
+        std::mutex lock;            // Guards tasks
+        std::deque<Task> tasks[NUM_PRIORITIES];     // Oldest at the front
+        std::atomic<long> executed;
+        std::atomic<long> steals;
+
+        Worker(): executed(0), steals(0) {
+        }
+    };
+
+    Options options;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<int> queued;        // Tasks waiting across every worker
+    std::atomic<size_t> next;       // Worker the next task is dealt to
+    std::atomic<int> sleeping;      // Workers waiting on ready, so submit can skip the lock
+
+    std::mutex lock;                // Guards stopping and sleeping workers
+    std::condition_variable ready;  // Signalled when a task is queued or the pool stops
+    bool stopping;
+
+public:
+    explicit Pool(const Options& options);
+    ~Pool();
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    // Queue a task, returning false if the queue is full
+    bool submit(Task task, Priority priority = PRIORITY_NORMAL);
+
+    // Run every queued task, then join the threads
+    void stop();
+
+    std::vector<Stats> stats();
+
+private:
+    void run(size_t index);
+    bool take(size_t index, Task& task);
+};
+
+}
+
+#endif // __WORKERS_H__